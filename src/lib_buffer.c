@@ -49,6 +49,54 @@ static LJ_AINLINE SBufExt *buffer_tobufw(lua_State *L)
 
 #define buffer_toudata(sbx)	((GCudata *)(sbx)-1)
 
+/* Create a new buffer object and push it. */
+static SBufExt *buffer_newobj(lua_State *L)
+{
+  GCtab *env = tabref(curr_func(L)->c.env);
+  GCudata *ud = lj_udata_new(L, sizeof(SBufExt), env);
+  SBufExt *sbx = (SBufExt *)uddata(ud);
+  ud->udtype = UDTYPE_BUFFER;
+  /* NOBARRIER: The GCudata is new (marked white). */
+  setgcref(ud->metatable, obj2gco(env));
+  setudataV(L, L->top++, ud);
+  lj_bufx_init(L, sbx);
+  setrawlightudV(&sbx->jnull, LJ_64 ? lj_lightud_intern(L, NULL) : NULL);
+  return sbx;
+}
+
+/* Set the serialization options of a new buffer. */
+static void buffer_setopt(lua_State *L, SBufExt *sbx, GCtab *options)
+{
+  cTValue *opt_dict, *opt_mt, *opt_obj, *opt_lazy, *opt_null;
+  opt_dict = lj_tab_getstr(options, lj_str_newlit(L, "dict"));
+  if (opt_dict && tvistab(opt_dict)) {
+    GCtab *dict_str = tabV(opt_dict);
+    lj_serialize_dict_prep_str(L, dict_str);
+    setgcref(sbx->dict_str, obj2gco(dict_str));
+  }
+  opt_mt = lj_tab_getstr(options, lj_str_newlit(L, "metatable"));
+  if (opt_mt && tvistab(opt_mt)) {
+    GCtab *dict_mt = tabV(opt_mt);
+    lj_serialize_dict_prep_mt(L, dict_mt);
+    setgcref(sbx->dict_mt, obj2gco(dict_mt));
+  }
+  opt_obj = lj_tab_getstr(options, lj_str_newlit(L, "objects"));
+  if (opt_obj && tvistab(opt_obj)) {
+    GCtab *dict_obj = tabV(opt_obj);
+    lj_serialize_dict_check_obj(L, dict_obj);
+    setgcref(sbx->dict_obj, obj2gco(dict_obj));
+  }
+  opt_lazy = lj_tab_getstr(options, lj_str_newlit(L, "lazystr"));
+  if (opt_lazy && tvisnumber(opt_lazy)) {
+    int32_t n = numberVint(opt_lazy);
+    sbx->lazystr = n > 0 ? (MSize)n : 0;
+  } else if (opt_lazy && tvistruecond(opt_lazy)) {
+    sbx->lazystr = LJ_SERIALIZE_LAZYSTR;
+  }
+  opt_null = lj_tab_getstr(options, lj_str_newlit(L, "null"));
+  if (opt_null && !tvisnil(opt_null)) copyTV(L, &sbx->jnull, opt_null);
+}
+
 /* -- Buffer methods ------------------------------------------------------ */
 
 #define LJLIB_MODULE_buffer_method
@@ -255,6 +303,112 @@ LJLIB_CF(buffer_method_decode)		LJLIB_REC(.)
   return 1;
 }
 
+LJLIB_NOREGUV LJLIB_CF(buffer_method_decode_next)
+{
+  SBufExt *sbx = buffer_tobufw(L);
+  int32_t i = lj_lib_checkint(L, 2);
+  MSize need;
+  if (!lj_serialize_size(sbx, &need))
+    return 0;  /* Stop before an incomplete object. */
+  setintV(L->top++, i+1);
+  setnilV(L->top++);
+  sbx->r = lj_serialize_get(sbx, L->top-1);
+  lj_gc_check(L);
+  return 2;
+}
+
+LJLIB_PUSH(lastcl)
+LJLIB_CF(buffer_method_decode_each)
+{
+  buffer_tobuf(L);
+  setfuncV(L, L->top++, funcV(lj_lib_upvalue(L, 1)));
+  copyTV(L, L->top++, L->base);
+  setintV(L->top++, 0);
+  return 3;
+}
+
+LJLIB_CF(buffer_method_decode_size)
+{
+  SBufExt *sbx = buffer_tobuf(L);
+  MSize need;
+  MSize sz = lj_serialize_size(sbx, &need);
+  if (sz) {
+    setintV(L->top++, (int32_t)sz);
+    return 1;
+  }
+  setnilV(L->top++);
+  setintV(L->top++, (int32_t)need);
+  return 2;
+}
+
+LJLIB_CF(buffer_method_encode_json)
+{
+  SBufExt *sbx = buffer_tobufw(L);
+  cTValue *o = lj_lib_checkany(L, 2);
+  lj_serialize_putjson(sbx, o);
+  lj_gc_check(L);
+  L->top = L->base+1;  /* Chain buffer object. */
+  return 1;
+}
+
+LJLIB_CF(buffer_method_decode_json)
+{
+  SBufExt *sbx = buffer_tobufw(L);
+  setnilV(L->top++);
+  sbx->r = lj_serialize_getjson(sbx, L->top-1);
+  lj_gc_check(L);
+  return 1;
+}
+
+LJLIB_NOREGUV LJLIB_CF(buffer_method_decode_json_next)
+{
+  SBufExt *sbx = buffer_tobufw(L);
+  int32_t i = lj_lib_checkint(L, 2);
+  if (!lj_serialize_sizejson(sbx))
+    return 0;  /* Stop before an incomplete value. */
+  setintV(L->top++, i+1);
+  setnilV(L->top++);
+  sbx->r = lj_serialize_getjson(sbx, L->top-1);
+  lj_gc_check(L);
+  return 2;
+}
+
+LJLIB_PUSH(lastcl)
+LJLIB_CF(buffer_method_decode_json_each)
+{
+  buffer_tobuf(L);
+  setfuncV(L, L->top++, funcV(lj_lib_upvalue(L, 1)));
+  copyTV(L, L->top++, L->base);
+  setintV(L->top++, 0);
+  return 3;
+}
+
+LJLIB_CF(buffer_method_snapshot)
+{
+  SBufExt *sbx = buffer_tobufw(L);
+  cTValue *o = lj_lib_checkany(L, 2);
+  lj_serialize_snapshot(sbx, o);
+  lj_gc_check(L);
+  L->top = L->base+1;  /* Chain buffer object. */
+  return 1;
+}
+
+LJLIB_CF(buffer_method_restore)
+{
+  SBufExt *sbx = buffer_tobufw(L);
+  TValue o;
+  sbx->r = lj_serialize_restore(sbx, &o);
+  copyTV(L, L->top++, &o);
+  lj_gc_check(L);
+  return 1;
+}
+
+LJLIB_CF(buffer_method_sync)
+{
+  SBufExt *sbx = buffer_tobuf(L);
+  return luaL_fileresult(L, lj_bufx_sync(sbx), NULL);
+}
+
 LJLIB_CF(buffer_method___gc)
 {
   SBufExt *sbx = buffer_tobuf(L);
@@ -290,43 +444,54 @@ LJLIB_CF(buffer_new)
 {
   MSize sz = 0;
   int targ = 1;
-  GCtab *env, *dict_str = NULL, *dict_mt = NULL;
-  GCudata *ud;
+  GCtab *options = NULL;
   SBufExt *sbx;
   if (L->base < L->top && !tvistab(L->base)) {
     targ = 2;
     if (!tvisnil(L->base))
       sz = (MSize)lj_lib_checkintrange(L, 1, 0, LJ_MAX_BUF);
   }
-  if (L->base+targ-1 < L->top) {
-    GCtab *options = lj_lib_checktab(L, targ);
-    cTValue *opt_dict, *opt_mt;
-    opt_dict = lj_tab_getstr(options, lj_str_newlit(L, "dict"));
-    if (opt_dict && tvistab(opt_dict)) {
-      dict_str = tabV(opt_dict);
-      lj_serialize_dict_prep_str(L, dict_str);
-    }
-    opt_mt = lj_tab_getstr(options, lj_str_newlit(L, "metatable"));
-    if (opt_mt && tvistab(opt_mt)) {
-      dict_mt = tabV(opt_mt);
-      lj_serialize_dict_prep_mt(L, dict_mt);
-    }
-  }
-  env = tabref(curr_func(L)->c.env);
-  ud = lj_udata_new(L, sizeof(SBufExt), env);
-  ud->udtype = UDTYPE_BUFFER;
-  /* NOBARRIER: The GCudata is new (marked white). */
-  setgcref(ud->metatable, obj2gco(env));
-  setudataV(L, L->top++, ud);
-  sbx = (SBufExt *)uddata(ud);
-  lj_bufx_init(L, sbx);
-  setgcref(sbx->dict_str, obj2gco(dict_str));
-  setgcref(sbx->dict_mt, obj2gco(dict_mt));
+  if (L->base+targ-1 < L->top)
+    options = lj_lib_checktab(L, targ);
+  sbx = buffer_newobj(L);
+  if (options) buffer_setopt(L, sbx, options);
   if (sz > 0) lj_buf_need2((SBuf *)sbx, sz);
   lj_gc_check(L);
   return 1;
 }
 
+LJLIB_CF(buffer_mmap)
+{
+  const char *path = strdata(lj_lib_checkstr(L, 1));
+  GCstr *mode;
+  int writable = 0, narg = (int)(L->top - L->base);
+  uint64_t ofs = 0, len = ~(uint64_t)0;
+  GCtab *options = NULL;
+  SBufExt *sbx;
+  if (narg > 1 && tvistab(L->top-1))  /* Trailing options table. */
+    options = tabV(L->top-1), narg--;
+  mode = narg > 1 ? lj_lib_optstr(L, 2) : NULL;
+  if (mode) {
+    const char *m = strdata(mode);
+    if (m[0] != 'r' || (m[1] && (m[1] != '+' || m[2])))
+      lj_err_arg(L, 2, LJ_ERR_INVOPT);
+    writable = (m[1] == '+');
+  }
+  if (narg > 2 && !tvisnil(L->base+2)) {
+    lua_Number n = lj_lib_checknum(L, 3);
+    if (!(n >= 0 && n < 9007199254740992.0)) lj_err_arg(L, 3, LJ_ERR_NUMRNG);
+    ofs = (uint64_t)n;
+  }
+  if (narg > 3 && !tvisnil(L->base+3))
+    len = (uint64_t)lj_lib_checkintrange(L, 4, 0, LJ_MAX_BUF-1);
+  sbx = buffer_newobj(L);
+  if (options) buffer_setopt(L, sbx, options);
+  if (!lj_bufx_map(sbx, tabref(curr_func(L)->c.env), path, writable, ofs, len))
+    return luaL_fileresult(L, 0, path);
+  lj_gc_check(L);
+  return 1;
+}
+
 LJLIB_CF(buffer_encode)			LJLIB_REC(.)
 {
   cTValue *o = lj_lib_checkany(L, 1);
@@ -354,6 +519,8 @@ int luaopen_string_buffer(lua_State *L)
   lua_getfield(L, -1, "__tostring");
   lua_setfield(L, -2, "tostring");
   LJ_LIB_REG(L, NULL, buffer);
+  lua_pushlightuserdata(L, NULL);
+  lua_setfield(L, -2, "null");
   return 1;
 }
 
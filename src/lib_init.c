@@ -33,6 +33,7 @@ static const luaL_Reg lj_lib_preload[] = {
 #if LJ_HASFFI
   { LUA_FFILIBNAME,	luaopen_ffi },
 #endif
+  { LUA_UTF8LIBNAME,	luaopen_utf8 },
   { NULL,		NULL }
 };
 
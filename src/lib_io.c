@@ -26,6 +26,10 @@
 #include "lj_ff.h"
 #include "lj_lib.h"
 
+#if LJ_TARGET_POSIX
+#include <sys/stat.h>
+#endif
+
 /* Userdata payload for I/O file. */
 typedef struct IOFileUD {
   FILE *fp;		/* File handle. */
@@ -39,6 +43,8 @@ typedef struct IOFileUD {
 
 #define IOFILE_FLAG_CLOSE	4	/* Close after io.lines() iterator. */
 
+#define IO_READ_DIRECT		65536	/* Read larger blocks into strings. */
+
 #define IOSTDF_UD(L, id)	(&gcref(G(L)->gcroot[(id)])->ud)
 #define IOSTDF_IOF(L, id)	((IOFileUD *)uddata(IOSTDF_UD(L, (id))))
 
@@ -157,9 +163,34 @@ static int io_file_readline(lua_State *L, FILE *fp, MSize chop)
   return (int)ok;
 }
 
+/* Read a block of known size directly into a new string. */
+static MSize io_file_readstr(lua_State *L, FILE *fp, MSize m)
+{
+  GCstr *s = lj_str_newraw(L, m);
+  MSize n = (MSize)fread(strdatawr(s), 1, m, fp);
+  setstrV(L, L->top++, lj_str_intern(L, s, n));
+  lj_gc_check(L);
+  return n;
+}
+
 static void io_file_readall(lua_State *L, FILE *fp)
 {
   MSize m, n;
+#if LJ_TARGET_POSIX
+  struct stat st;
+  long pos;
+  if (fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+      (pos = ftell(fp)) >= 0 && st.st_size - pos >= IO_READ_DIRECT &&
+      st.st_size - pos < LJ_MAX_STR-1) {
+    /* Regular file: read the rest directly. One more byte detects EOF. */
+    m = (MSize)(st.st_size - pos) + 1;
+    if (io_file_readstr(L, fp, m) == m) {  /* File has grown meanwhile? */
+      io_file_readall(L, fp);
+      lua_concat(L, 2);
+    }
+    return;
+  }
+#endif
   for (m = LUAL_BUFFERSIZE, n = 0; ; m += m) {
     char *buf = lj_buf_tmp(L, m);
     n += (MSize)fread(buf+n, 1, m-n, fp);
@@ -173,7 +204,9 @@ static void io_file_readall(lua_State *L, FILE *fp)
 
 static int io_file_readlen(lua_State *L, FILE *fp, MSize m)
 {
-  if (m) {
+  if (m >= IO_READ_DIRECT) {
+    return io_file_readstr(L, fp, m) > 0;
+  } else if (m) {
     char *buf = lj_buf_tmp(L, m);
     MSize n = (MSize)fread(buf, 1, m, fp);
     setstrV(L, L->top++, lj_str_new(L, buf, (size_t)n));
@@ -246,6 +279,114 @@ static int io_file_write(lua_State *L, IOFileUD *iof, int start)
   return luaL_fileresult(L, status, NULL);
 }
 
+#if LJ_HASBUFFER
+/* -- Buffer read/write helpers ------------------------------------------- */
+
+/* Check for a string buffer argument and prepare it for writing. */
+static SBufExt *io_tobuf(lua_State *L, int narg)
+{
+  SBufExt *sbx;
+  if (!(L->base+narg < L->top && tvisbuf(L->base+narg)))
+    lj_err_argtype(L, narg+1, "buffer");
+  sbx = bufV(L->base+narg);
+  setsbufXL_(sbx, L);
+  return sbx;
+}
+
+/* Read a block of up to m bytes directly into a buffer. */
+static MSize io_file_readblock(FILE *fp, SBufExt *sbx, MSize m)
+{
+  char *w = lj_buf_more((SBuf *)sbx, m);
+  MSize n = (MSize)fread(w, 1, m, fp);
+  sbx->w = w + n;
+  return n;
+}
+
+/* Read a line into a buffer. */
+static MSize io_file_readlineinto(FILE *fp, SBufExt *sbx, MSize chop)
+{
+  MSize n = 0;
+  for (;;) {
+    char *w = lj_buf_more((SBuf *)sbx, LUAL_BUFFERSIZE);
+    MSize k;
+    if (fgets(w, LUAL_BUFFERSIZE, fp) == NULL) break;
+    k = (MSize)strlen(w);
+    n += k;
+    sbx->w = w + k;
+    if (k && w[k-1] == '\n') { sbx->w -= chop; break; }
+  }
+  return n;
+}
+
+/* Read into the buffer at base+start, with an optional format after it.
+** Pushes the number of bytes read or nil at EOF.
+*/
+static int io_file_readinto(lua_State *L, IOFileUD *iof, int start)
+{
+  FILE *fp = iof->fp;
+  SBufExt *sbx = io_tobuf(L, start);
+  cTValue *o = L->base+start+1;
+  MSize len0 = sbufxlen(sbx);
+  int fmt = 'l', ok;
+  if (o < L->top && !tvisnil(o)) {
+    if (tvisstr(o)) {
+      const char *p = strVdata(o);
+      if (p[0] == '*') p++;
+      fmt = p[0];
+      if (!((fmt & ~0x20) == 'L' || fmt == 'a'))
+	lj_err_arg(L, start+2, LJ_ERR_INVFMT);
+    } else if (tvisnumber(o)) {
+      fmt = 0;
+    } else {
+      lj_err_arg(L, start+2, LJ_ERR_INVOPT);
+    }
+  }
+  clearerr(fp);
+  if ((fmt & ~0x20) == 'L') {
+    ok = io_file_readlineinto(fp, sbx, (fmt == 'l')) != 0;
+  } else if (fmt == 'a') {
+    MSize m = LUAL_BUFFERSIZE;
+    while (io_file_readblock(fp, sbx, m) == m)
+      if (m < LJ_MAX_BUF/4) m += m;
+    ok = 1;
+  } else {
+    MSize m = (MSize)lj_lib_checkintrange(L, start+2, 0, LJ_MAX_BUF-1);
+    if (m) {
+      ok = io_file_readblock(fp, sbx, m) > 0;
+    } else {
+      int c = getc(fp);
+      ungetc(c, fp);
+      ok = (c != EOF);
+    }
+  }
+  if (ferror(fp))
+    return luaL_fileresult(L, 0, NULL);
+  if (ok)
+    setintV(L->top++, (int32_t)(sbufxlen(sbx) - len0));
+  else
+    setnilV(L->top++);
+  return 1;
+}
+
+/* Write from the buffer at base+start and consume the written data. */
+static int io_file_writefrom(lua_State *L, IOFileUD *iof, int start)
+{
+  SBufExt *sbx = io_tobuf(L, start);
+  MSize len = sbufxlen(sbx), n;
+  if (L->base+start+1 < L->top && !tvisnil(L->base+start+1)) {
+    MSize m = (MSize)lj_lib_checkintrange(L, start+2, 0, LJ_MAX_BUF-1);
+    if (m < len) len = m;
+  }
+  n = (MSize)fwrite(sbx->r, 1, len, iof->fp);
+  sbx->r += n;
+  if (sbx->r == sbx->w && !sbufiscow(sbx)) sbx->r = sbx->w = sbx->b;
+  if (n != len)
+    return luaL_fileresult(L, 0, NULL);
+  setintV(L->top++, (int32_t)n);
+  return 1;
+}
+#endif
+
 static int io_file_iter(lua_State *L)
 {
   GCfunc *fn = curr_func(L);
@@ -259,6 +400,21 @@ static int io_file_iter(lua_State *L)
     memcpy(L->top, &fn->c.upvalue[1], n*sizeof(TValue));
     L->top += n;
   }
+#if LJ_HASBUFFER
+  if (n && tvisbuf(L->base)) {  /* Read into the same buffer each time. */
+    lj_bufx_reset(bufV(L->base));
+    n = io_file_readinto(L, iof, 0);
+    if (ferror(iof->fp))
+      lj_err_callermsg(L, strVdata(L->top-2));
+    if (tvisnil(L->top-1)) {
+      if ((iof->type & IOFILE_FLAG_CLOSE))
+	io_file_close(L, iof);  /* Return values are ignored. */
+      return 0;
+    }
+    copyTV(L, L->top-1, L->base);
+    return 1;
+  }
+#endif
   n = io_file_read(L, iof, 0);
   if (ferror(iof->fp))
     lj_err_callermsg(L, strVdata(L->top-2));
@@ -305,6 +461,18 @@ LJLIB_CF(io_method_write)		LJLIB_REC(io_write 0)
   return io_file_write(L, io_tofile(L), 1);
 }
 
+#if LJ_HASBUFFER
+LJLIB_CF(io_method_readinto)
+{
+  return io_file_readinto(L, io_tofile(L), 1);
+}
+
+LJLIB_CF(io_method_writefrom)
+{
+  return io_file_writefrom(L, io_tofile(L), 1);
+}
+#endif
+
 LJLIB_CF(io_method_flush)		LJLIB_REC(io_flush 0)
 {
   return luaL_fileresult(L, fflush(io_tofile(L)->fp) == 0, NULL);
@@ -32,6 +32,7 @@
 #include "lj_dispatch.h"
 #include "lj_vm.h"
 #include "lj_vmevent.h"
+#include "lj_alloc.h"
 #include "lj_lib.h"
 
 #include "luajit.h"
@@ -411,6 +412,38 @@ LJLIB_CF(jit_util_ircalladdr)
   return 0;
 }
 
+/* local info = jit.util.meminfo() */
+LJLIB_CF(jit_util_meminfo)
+{
+  jit_State *J = L2J(L);
+  size_t heap = 0, heaphuge = 0, mcode = 0, mcodehuge = 0;
+  MCode *mc = J->mcarea;
+  size_t sz = J->szmcarea;
+  GCtab *t;
+  while (mc) {
+    mcode += sz;
+#if LJ_HUGEPAGES
+    if (sz >= LJ_HUGEPAGESIZE && !((uintptr_t)mc & (LJ_HUGEPAGESIZE-1)))
+      mcodehuge += sz;
+#endif
+    sz = ((MCLink *)mc)->size;
+    mc = ((MCLink *)mc)->next;
+  }
+#ifndef LUAJIT_USE_SYSMALLOC
+  if (G(L)->allocf == lj_alloc_f)
+    lj_alloc_meminfo(G(L)->allocd, &heap, &heaphuge);
+#endif
+  lua_createtable(L, 0, 4);
+  t = tabV(L->top-1);
+  setnumV(lj_tab_setstr(L, t, lj_str_newlit(L, "heap")), (lua_Number)heap);
+  setnumV(lj_tab_setstr(L, t, lj_str_newlit(L, "heaphuge")),
+	  (lua_Number)heaphuge);
+  setnumV(lj_tab_setstr(L, t, lj_str_newlit(L, "mcode")), (lua_Number)mcode);
+  setnumV(lj_tab_setstr(L, t, lj_str_newlit(L, "mcodehuge")),
+	  (lua_Number)mcodehuge);
+  return 1;
+}
+
 #endif
 
 #include "lj_libdef.h"
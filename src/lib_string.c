@@ -161,6 +161,7 @@ typedef struct MatchState {
   lua_State *L;
   int level;  /* total number of captures (finished or unfinished) */
   int depth;
+  const struct PatProg *prog;  /* Compiled pattern or NULL. */
   struct {
     const char *init;
     ptrdiff_t len;
@@ -434,6 +435,327 @@ static const char *match(MatchState *ms, const char *s, const char *p)
   return s;
 }
 
+/* -- Compiled patterns --------------------------------------------------- */
+
+/*
+** Frequently used patterns are compiled into a list of items on first use
+** and cached in a weak table keyed by the pattern string. Every single
+** char item gets a 256 bit set, which is built with singlematch(), so the
+** semantics are exactly the same as for the interpreter above. Patterns
+** which are too long or malformed are left to the interpreter, which
+** throws the usual errors at the usual time.
+*/
+
+#define PAT_MAXLEN	128	/* Max. length of a compiled pattern. */
+
+enum {
+  PI_END, PI_EOS, PI_OPEN, PI_POS, PI_CLOSE, PI_BAL, PI_FRONT, PI_BACKREF,
+  PI_CHAR, PI_SET
+};
+
+typedef struct PatItem {
+  uint8_t op;		/* Item type, PI_*. */
+  uint8_t quant;	/* Quantifier: 0, '?', '*', '+' or '-'. */
+  uint8_t a, b;		/* Operands for %b and back references. */
+  uint32_t set[8];	/* Char set for PI_CHAR, PI_SET and PI_FRONT. */
+} PatItem;
+
+typedef struct PatProg {
+  uint8_t anchor;	/* Pattern starts with '^'. */
+  uint8_t first;	/* Index of first char item for the prefilter. */
+  uint8_t skip;		/* Prefilter: 0 = none, 1 = char set, 2 = prefix. */
+  uint8_t plen;		/* Length of literal prefix. */
+  char prefix[PAT_MAXLEN];  /* Literal prefix. */
+  PatItem item[1];	/* Items, terminated by PI_END. */
+} PatProg;
+
+#define pi_inset(pi, c)	(((pi)->set[(c) >> 5] >> ((c) & 31)) & 1)
+
+/* Find the end of a single char class or return NULL if malformed. */
+static const char *pat_classend(const char *p)
+{
+  switch (*p++) {
+  case L_ESC:
+    return *p == '\0' ? NULL : p+1;
+  case '[':
+    if (*p == '^') p++;
+    do {
+      if (*p == '\0') return NULL;
+      if (*(p++) == L_ESC && *p != '\0')
+	p++;
+    } while (*p != ']');
+    return p+1;
+  default:
+    return p;
+  }
+}
+
+/* Compile pattern into items. Returns number of items or 0 if malformed. */
+static MSize pat_compile(PatItem *pi, const char *p)
+{
+  PatItem *pi0 = pi;
+  for (;; pi++) {
+    const char *ep;
+    int c;
+    memset(pi, 0, sizeof(PatItem));
+    switch (*p) {
+    case '(':
+      if (*(p+1) == ')') { pi->op = PI_POS; p += 2; }
+      else { pi->op = PI_OPEN; p++; }
+      continue;
+    case ')':
+      pi->op = PI_CLOSE; p++;
+      continue;
+    case L_ESC:
+      if (*(p+1) == 'b') {
+	if (*(p+2) == 0 || *(p+3) == 0) return 0;
+	pi->op = PI_BAL; pi->a = uchar(*(p+2)); pi->b = uchar(*(p+3));
+	p += 4;
+	continue;
+      } else if (*(p+1) == 'f') {
+	p += 2;
+	if (*p != '[' || !(ep = pat_classend(p))) return 0;
+	for (c = 0; c < 256; c++)
+	  if (matchbracketclass(c, p, ep-1))
+	    pi->set[c >> 5] |= 1u << (c & 31);
+	pi->op = PI_FRONT; p = ep;
+	continue;
+      } else if (lj_char_isdigit(uchar(*(p+1)))) {
+	pi->op = PI_BACKREF; pi->a = uchar(*(p+1)); p += 2;
+	continue;
+      }
+      break;
+    case '\0':
+      pi->op = PI_END;
+      return (MSize)(pi - pi0) + 1;
+    case '$':
+      if (*(p+1) == '\0') { pi->op = PI_EOS; p++; continue; }
+      break;
+    default:
+      break;
+    }
+    if (!(ep = pat_classend(p))) return 0;
+    if (ep == p+1 && *p != '.') {  /* Plain char. */
+      pi->op = PI_CHAR; pi->a = uchar(*p);
+      pi->set[pi->a >> 5] = 1u << (pi->a & 31);
+    } else {
+      int n = 0;
+      for (c = 0; c < 256; c++)
+	if (singlematch(c, p, ep)) {
+	  pi->set[c >> 5] |= 1u << (c & 31);
+	  pi->a = (uint8_t)c; n++;
+	}
+      pi->op = n == 1 ? PI_CHAR : PI_SET;  /* E.g. an escaped char. */
+    }
+    if (*ep == '?' || *ep == '*' || *ep == '+' || *ep == '-') {
+      pi->quant = uchar(*ep);
+      ep++;
+    }
+    p = ep;
+  }
+}
+
+/* Set up the prefilter for the start positions of a match. */
+static void pat_prefilter(PatProg *pp)
+{
+  const PatItem *pi = pp->item;
+  MSize n = 0;
+  while (pi->op == PI_OPEN || pi->op == PI_POS) pi++;
+  pp->first = (uint8_t)(pi - pp->item);
+  while (pi->op == PI_CHAR && !pi->quant) {
+    pp->prefix[n++] = (char)pi->a;
+    pi++;
+  }
+  if (n == 0 && pi->op == PI_CHAR && pi->quant == '+')
+    pp->prefix[n++] = (char)pi->a;
+  pp->plen = (uint8_t)n;
+  if (n) {
+    pp->skip = 2;
+  } else {
+    pi = &pp->item[pp->first];
+    if (pi->op == PI_SET && (!pi->quant || pi->quant == '+'))
+      pp->skip = 1;
+  }
+}
+
+/* Get compiled pattern from cache or compile it. Anchors it on the stack. */
+static const PatProg *pat_get(lua_State *L, GCstr *p)
+{
+  global_State *g = G(L);
+  GCtab *t = tabref(g->gcroot[GCROOT_STR_PATCACHE]);
+  cTValue *tv;
+  if (p->len > PAT_MAXLEN || !t) return NULL;
+  tv = lj_tab_getstr(t, p);
+  if (tv && tvisudata(tv)) {
+    setudataV(L, L->top++, udataV(tv));
+  } else {
+    PatItem item[PAT_MAXLEN+2];
+    const char *ps = strdata(p);
+    int anchor = (*ps == '^');
+    MSize n = pat_compile(item, ps + anchor);
+    PatProg *pp;
+    if (n == 0) return NULL;
+    pp = (PatProg *)lua_newuserdata(L,
+	   sizeof(PatProg) + (n-1)*sizeof(PatItem));
+    pp->anchor = (uint8_t)anchor;
+    pp->skip = 0;
+    memcpy(pp->item, item, n*sizeof(PatItem));
+    pat_prefilter(pp);
+    setudataV(L, lj_tab_setstr(L, t, p), udataV(L->top-1));
+    lj_gc_anybarriert(L, t);
+  }
+  return (const PatProg *)uddata(udataV(L->top-1));
+}
+
+/* Skip to the next possible start of a match. Returns NULL if none. */
+static const char *pat_skip(MatchState *ms, const char *s)
+{
+  const PatProg *pp = ms->prog;
+  if (pp && pp->skip) {
+    if (pp->skip == 2) {
+      return lj_str_find(s, pp->prefix, (MSize)(ms->src_end - s), pp->plen);
+    } else {
+      const PatItem *pi = &pp->item[pp->first];
+      for (; s < ms->src_end; s++)
+	if (pi_inset(pi, uchar(*s))) return s;
+      return NULL;
+    }
+  }
+  return s;
+}
+
+static const char *pat_match(MatchState *ms, const char *s, const PatItem *pi);
+
+static const char *pat_max_expand(MatchState *ms, const char *s,
+				  const PatItem *pi)
+{
+  ptrdiff_t i = 0;
+  while ((s+i) < ms->src_end && pi_inset(pi, uchar(*(s+i))))
+    i++;
+  if ((pi+1)->op == PI_END)  /* Trailing item: longest match wins. */
+    return s+i;
+  for (; i >= 0; i--) {
+    const char *res = pat_match(ms, s+i, pi+1);
+    if (res) return res;
+  }
+  return NULL;
+}
+
+static const char *pat_min_expand(MatchState *ms, const char *s,
+				  const PatItem *pi)
+{
+  for (;;) {
+    const char *res = pat_match(ms, s, pi+1);
+    if (res != NULL)
+      return res;
+    else if (s < ms->src_end && pi_inset(pi, uchar(*s)))
+      s++;
+    else
+      return NULL;
+  }
+}
+
+static const char *pat_match(MatchState *ms, const char *s, const PatItem *pi)
+{
+  if (++ms->depth > LJ_MAX_XLEVEL)
+    lj_err_caller(ms->L, LJ_ERR_STRPATX);
+  again:
+  switch (pi->op) {
+  case PI_END:
+    break;
+  case PI_EOS:
+    if (s != ms->src_end) s = NULL;
+    break;
+  case PI_OPEN: case PI_POS: {
+    int level = ms->level;
+    if (level >= LUA_MAXCAPTURES) lj_err_caller(ms->L, LJ_ERR_STRCAPN);
+    ms->capture[level].init = s;
+    ms->capture[level].len = pi->op == PI_POS ? CAP_POSITION : CAP_UNFINISHED;
+    ms->level = level+1;
+    if ((s = pat_match(ms, s, pi+1)) == NULL)
+      ms->level--;  /* Undo capture. */
+    break;
+    }
+  case PI_CLOSE: {
+    int l = capture_to_close(ms);
+    const char *res;
+    ms->capture[l].len = s - ms->capture[l].init;
+    if ((res = pat_match(ms, s, pi+1)) == NULL)
+      ms->capture[l].len = CAP_UNFINISHED;  /* Undo capture. */
+    s = res;
+    break;
+    }
+  case PI_BAL:
+    if (uchar(*s) != pi->a) {
+      s = NULL;
+    } else {
+      int cont = 1;
+      while (++s < ms->src_end) {
+	if (uchar(*s) == pi->b) {
+	  if (--cont == 0) break;
+	} else if (uchar(*s) == pi->a) {
+	  cont++;
+	}
+      }
+      if (s >= ms->src_end) { s = NULL; break; }
+      s++; pi++;
+      goto again;
+    }
+    break;
+  case PI_FRONT: {
+    int previous = (s == ms->src_init) ? 0 : uchar(*(s-1));
+    if (pi_inset(pi, previous) || !pi_inset(pi, uchar(*s))) {
+      s = NULL;
+      break;
+    }
+    pi++;
+    goto again;
+    }
+  case PI_BACKREF:
+    s = match_capture(ms, s, pi->a);
+    if (s == NULL) break;
+    pi++;
+    goto again;
+  default: {  /* PI_CHAR or PI_SET. */
+    int m = s < ms->src_end && pi_inset(pi, uchar(*s));
+    switch (pi->quant) {
+    case '?': {
+      const char *res;
+      if (m && ((res = pat_match(ms, s+1, pi+1)) != NULL)) {
+	s = res;
+	break;
+      }
+      pi++;
+      goto again;
+      }
+    case '*':
+      s = pat_max_expand(ms, s, pi);
+      break;
+    case '+':
+      s = (m ? pat_max_expand(ms, s+1, pi) : NULL);
+      break;
+    case '-':
+      s = pat_min_expand(ms, s, pi);
+      break;
+    default:
+      if (m) { s++; pi++; goto again; }
+      s = NULL;
+      break;
+    }
+    break;
+    }
+  }
+  ms->depth--;
+  return s;
+}
+
+/* Match at position s, using the compiled pattern, if any. */
+static LJ_AINLINE const char *str_match(MatchState *ms, const char *s,
+					const char *p)
+{
+  return ms->prog ? pat_match(ms, s, ms->prog->item) : match(ms, s, p);
+}
+
 static void push_onecapture(MatchState *ms, int i, const char *s, const char *e)
 {
   if (i >= ms->level) {
@@ -495,10 +817,12 @@ static int str_find_aux(lua_State *L, int find)
     ms.L = L;
     ms.src_init = strdata(s);
     ms.src_end = strdata(s) + s->len;
+    ms.prog = pat_get(L, p);
     do {  /* Loop through string and try to match the pattern. */
       const char *q;
+      if (!anchor && !(sstr = pat_skip(&ms, sstr))) break;
       ms.level = ms.depth = 0;
-      q = match(&ms, sstr, pstr);
+      q = str_match(&ms, sstr, pstr);
       if (q) {
 	if (find) {
 	  setintV(L->top++, (int32_t)(sstr-(strdata(s)-1)));
@@ -531,14 +855,18 @@ LJLIB_NOREG LJLIB_CF(string_gmatch_aux)
   const char *s = strdata(str);
   TValue *tvpos = lj_lib_upvalue(L, 3);
   const char *src = s + tvpos->u32.lo;
+  TValue *tvprog = lj_lib_upvalue(L, 4);
   MatchState ms;
   ms.L = L;
   ms.src_init = s;
   ms.src_end = s + str->len;
+  ms.prog = NULL;
+  if (tvisudata(tvprog)) ms.prog = (const PatProg *)uddata(udataV(tvprog));
   for (; src <= ms.src_end; src++) {
     const char *e;
+    if (!(src = pat_skip(&ms, src))) break;
     ms.level = ms.depth = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
+    if ((e = str_match(&ms, src, p)) != NULL) {
       int32_t pos = (int32_t)(e - s);
       if (e == src) pos++;  /* Ensure progress for empty match. */
       tvpos->u32.lo = (uint32_t)pos;
@@ -550,11 +878,16 @@ LJLIB_NOREG LJLIB_CF(string_gmatch_aux)
 
 LJLIB_CF(string_gmatch)
 {
+  GCstr *p;
   lj_lib_checkstr(L, 1);
-  lj_lib_checkstr(L, 2);
-  L->top = L->base+3;
-  (L->top-1)->u64 = 0;
-  lj_lib_pushcc(L, lj_cf_string_gmatch_aux, FF_string_gmatch_aux, 3);
+  p = lj_lib_checkstr(L, 2);
+  L->top = L->base+4;
+  (L->top-2)->u64 = 0;
+  setnilV(L->top-1);
+  /* A leading '^' is not an anchor for gmatch. Leave it to the interpreter. */
+  if (*strdata(p) != '^' && pat_get(L, p))
+    copyTV(L, L->base+3, --L->top);
+  lj_lib_pushcc(L, lj_cf_string_gmatch_aux, FF_string_gmatch_aux, 4);
   return 1;
 }
 
@@ -615,7 +948,8 @@ LJLIB_CF(string_gsub)
 {
   size_t srcl;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checkstring(L, 2);
+  GCstr *pat = lj_lib_checkstr(L, 2);
+  const char *p = strdata(pat);
   int  tr = lua_type(L, 3);
   int max_s = luaL_optint(L, 4, (int)(srcl+1));
   int anchor = (*p == '^') ? (p++, 1) : 0;
@@ -625,14 +959,21 @@ LJLIB_CF(string_gsub)
   if (!(tr == LUA_TNUMBER || tr == LUA_TSTRING ||
 	tr == LUA_TFUNCTION || tr == LUA_TTABLE))
     lj_err_arg(L, 3, LJ_ERR_NOSFT);
-  luaL_buffinit(L, &b);
   ms.L = L;
   ms.src_init = src;
   ms.src_end = src+srcl;
+  ms.prog = pat_get(L, pat);
+  luaL_buffinit(L, &b);
   while (n < max_s) {
     const char *e;
+    if (!anchor) {  /* Copy the part which cannot match. */
+      const char *q = pat_skip(&ms, src);
+      if (!q) break;
+      luaL_addlstring(&b, src, (size_t)(q-src));
+      src = q;
+    }
     ms.level = ms.depth = 0;
-    e = match(&ms, src, p);
+    e = str_match(&ms, src, p);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
@@ -682,6 +1023,19 @@ LUALIB_API int luaopen_string(lua_State *L)
   setgcref(basemt_it(g, LJ_TSTR), obj2gco(mt));
   settabV(L, lj_tab_setstr(L, mt, mmname_str(g, MM_index)), tabV(L->top-1));
   mt->nomm = (uint8_t)(~(1u<<MM_index));
+  /* Weak tables for compiled patterns and formats. */
+  lua_createtable(L, 0, 1);
+  lua_pushliteral(L, "v");
+  lua_setfield(L, -2, "__mode");
+  lua_createtable(L, 0, 0);
+  lua_pushvalue(L, -2);
+  lua_setmetatable(L, -2);
+  setgcref(g->gcroot[GCROOT_STR_PATCACHE], obj2gco(tabV(L->top-1)));
+  lua_createtable(L, 0, 0);
+  lua_pushvalue(L, -3);
+  lua_setmetatable(L, -2);
+  setgcref(g->gcroot[GCROOT_STR_FMTCACHE], obj2gco(tabV(L->top-1)));
+  L->top -= 3;
 #if LJ_HASBUFFER
   lj_lib_prereg(L, LUA_STRLIBNAME ".buffer", luaopen_string_buffer, tabV(L->top-1));
 #endif
@@ -0,0 +1,172 @@
+/*
+** UTF-8 library.
+** Copyright (C) 2005-2023 Mike Pall. See Copyright Notice in luajit.h
+**
+** API and semantics follow the Lua 5.3 utf8 library.
+** Copyright (C) 1994-2015 Lua.org, PUC-Rio. See Copyright Notice in lua.h
+*/
+
+#define lib_utf8_c
+#define LUA_LIB
+
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+
+#include "lj_obj.h"
+#include "lj_gc.h"
+#include "lj_err.h"
+#include "lj_buf.h"
+#include "lj_str.h"
+#include "lj_state.h"
+#include "lj_ff.h"
+#include "lj_lib.h"
+
+/* ------------------------------------------------------------------------ */
+
+#define LJLIB_MODULE_utf8
+
+#define utf8_iscont(p)	((*(const uint8_t *)(p) & 0xc0) == 0x80)
+
+/* Translate a relative string position. Negative means back from end. */
+static int32_t utf8_posrelat(int32_t pos, MSize len)
+{
+  if (pos >= 0) return pos;
+  else if ((MSize)0 - (MSize)pos > len) return 0;
+  else return (int32_t)len + pos + 1;
+}
+
+LJLIB_CF(utf8_len)		LJLIB_REC(.)
+{
+  GCstr *s = lj_lib_checkstr(L, 1);
+  int32_t i = utf8_posrelat(lj_lib_optint(L, 2, 1), s->len);
+  int32_t j = utf8_posrelat(lj_lib_optint(L, 3, -1), s->len);
+  const char *p = strdata(s), *q;
+  MSize n;
+  if (!(1 <= i && --i <= (int32_t)s->len))
+    lj_err_arg(L, 2, LJ_ERR_IDXRNG);
+  if (!(--j < (int32_t)s->len))
+    lj_err_arg(L, 3, LJ_ERR_IDXRNG);
+  /* A char starting at j may end beyond it. */
+  q = lj_str_utf8scan(p+i, p+j+1, p+s->len, &n);
+  if (q < p+j+1) {  /* Return nil and the position of the invalid byte. */
+    setnilV(L->top++);
+    setintV(L->top++, (int32_t)(q - p) + 1);
+    return 2;
+  }
+  setintV(L->top++, (int32_t)n);
+  return 1;
+}
+
+LJLIB_CF(utf8_char)		LJLIB_REC(.)
+{
+  int i, nargs = (int)(L->top - L->base);
+  SBuf *sb = lj_buf_tmp_(L);
+  for (i = 1; i <= nargs; i++) {
+    int32_t c = lj_lib_checkint(L, i);
+    if ((uint32_t)c > 0x10ffff)
+      lj_err_arg(L, i, LJ_ERR_NUMRNG);
+    lj_buf_pututf8(sb, (uint32_t)c);
+  }
+  setstrV(L, L->top++, lj_buf_str(L, sb));
+  lj_gc_check(L);
+  return 1;
+}
+
+LJLIB_CF(utf8_codepoint)
+{
+  GCstr *s = lj_lib_checkstr(L, 1);
+  int32_t i = utf8_posrelat(lj_lib_optint(L, 2, 1), s->len);
+  int32_t j = utf8_posrelat(lj_lib_optint(L, 3, i), s->len);
+  const char *p = strdata(s), *e = p + s->len, *q;
+  int n = 0;
+  if (i < 1)
+    lj_err_arg(L, 2, LJ_ERR_IDXRNG);
+  if (j > (int32_t)s->len)
+    lj_err_arg(L, 3, LJ_ERR_IDXRNG);
+  if (i > j) return 0;
+  if ((uint32_t)(j - i) >= LUAI_MAXCSTACK)
+    lj_err_caller(L, LJ_ERR_STRSLC);
+  lj_state_checkstack(L, (MSize)(j - i + 1));
+  for (q = p + j, p += i-1; p < q; n++) {
+    uint32_t c;
+    p = lj_str_utf8dec(p, e, &c);
+    if (!p)
+      lj_err_caller(L, LJ_ERR_UTF8INV);
+    setintV(L->top++, (int32_t)c);
+  }
+  return n;
+}
+
+LJLIB_CF(utf8_offset)
+{
+  GCstr *s = lj_lib_checkstr(L, 1);
+  const char *p = strdata(s);
+  int32_t len = (int32_t)s->len;
+  int32_t n = lj_lib_checkint(L, 2);
+  int32_t i = utf8_posrelat(lj_lib_optint(L, 3, n >= 0 ? 1 : len+1), s->len);
+  if (!(1 <= i && --i <= len))
+    lj_err_arg(L, 3, LJ_ERR_IDXRNG);
+  if (n == 0) {  /* Find the start of the char containing byte i. */
+    while (i > 0 && utf8_iscont(p+i)) i--;
+  } else {
+    if (utf8_iscont(p+i))
+      lj_err_caller(L, LJ_ERR_UTF8CONT);
+    if (n < 0) {
+      for (; n < 0 && i > 0; n++)
+	do { i--; } while (i > 0 && utf8_iscont(p+i));
+    } else {
+      for (n--; n > 0 && i < len; n--)
+	do { i++; } while (utf8_iscont(p+i));  /* Stops at the final NUL. */
+    }
+  }
+  if (n == 0)
+    setintV(L->top++, i+1);
+  else
+    setnilV(L->top++);
+  return 1;
+}
+
+LJLIB_NOREGUV LJLIB_CF(utf8_codes_aux)
+{
+  GCstr *s = lj_lib_checkstr(L, 1);
+  const char *p = strdata(s), *e = p + s->len, *q;
+  int32_t i = lj_lib_checkint(L, 2) - 1;
+  uint32_t c;
+  if (i < 0) {
+    i = 0;  /* First iteration. */
+  } else if (i < (int32_t)s->len) {  /* Skip current char. */
+    for (i++; utf8_iscont(p+i); i++) ;
+  }
+  if (i >= (int32_t)s->len)
+    return 0;
+  q = lj_str_utf8dec(p+i, e, &c);
+  if (!q || utf8_iscont(q))
+    lj_err_caller(L, LJ_ERR_UTF8INV);
+  setintV(L->top++, i+1);
+  setintV(L->top++, (int32_t)c);
+  return 2;
+}
+
+LJLIB_PUSH(lastcl)
+LJLIB_CF(utf8_codes)
+{
+  lj_lib_checkstr(L, 1);
+  setfuncV(L, L->top++, funcV(lj_lib_upvalue(L, 1)));
+  copyTV(L, L->top++, L->base);
+  setintV(L->top++, 0);
+  return 3;
+}
+
+/* ------------------------------------------------------------------------ */
+
+#include "lj_libdef.h"
+
+LUALIB_API int luaopen_utf8(lua_State *L)
+{
+  LJ_LIB_REG(L, LUA_UTF8LIBNAME, utf8);
+  /* Lua 5.1 patterns need %z to match NUL. */
+  lua_pushliteral(L, "[%z\1-\x7F\xC2-\xF4][\x80-\xBF]*");
+  lua_setfield(L, -2, "charpattern");
+  return 1;
+}
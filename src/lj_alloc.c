@@ -38,10 +38,34 @@
 #define MAX_SIZE_T		(~(size_t)0)
 #define MALLOC_ALIGNMENT	((size_t)8U)
 
+#if LJ_HUGEPAGES
+#define DEFAULT_GRANULARITY	((size_t)LJ_HUGEPAGESIZE)
+#else
 #define DEFAULT_GRANULARITY	((size_t)128U * (size_t)1024U)
+#endif
 #define DEFAULT_TRIM_THRESHOLD	((size_t)2U * (size_t)1024U * (size_t)1024U)
 #define DEFAULT_MMAP_THRESHOLD	((size_t)128U * (size_t)1024U)
 #define MAX_RELEASE_CHECK_RATE	255
+#define SLAB_MAXSIZE		128	/* Max. size of blocks served by slabs. */
+#define SLAB_CACHE		4	/* Max. number of cached empty spans. */
+#if LJ_ALLOCSHARED
+/* Small spans limit the memory held by each state. */
+#define SLAB_SPAN		((size_t)4U * (size_t)1024U)
+#define SLAB_POOL		4096	/* Max. resident spans in shared pool. */
+#else
+#define SLAB_SPAN		((size_t)64U * (size_t)1024U)
+#endif
+#if LJ_HUGEPAGES
+#define SLAB_REGION		((size_t)LJ_HUGEPAGESIZE)
+#else
+#define SLAB_REGION		((size_t)256U * (size_t)1024U)
+#endif
+#define ALLOC_DEFER_MAX		256	/* Deferred frees per handoff. */
+#define ALLOC_FREE_BATCH	64	/* Frees per lock held by helper thread. */
+
+#if LJ_ASYNCFREE || LJ_ALLOCSHARED
+#include <pthread.h>
+#endif
 
 /* ------------------- size_t and alignment properties -------------------- */
 
@@ -387,6 +411,50 @@ static void *CALL_MREMAP_(void *ptr, size_t osz, size_t nsz, int flags)
 #define CALL_MREMAP(addr, osz, nsz, mv) ((void)osz, MFAIL)
 #endif
 
+#if LJ_HUGEPAGES
+/* Map memory aligned to huge pages and ask for huge page backing. */
+static void *mmap_huge(PRNGState *rs, size_t size)
+{
+  char *p, *q;
+  if (size < LJ_HUGEPAGESIZE)
+    return CALL_MMAP(rs, size);
+#if defined(LUAJIT_USE_HUGETLB) && defined(MAP_HUGETLB)
+  if ((size & (LJ_HUGEPAGESIZE-1)) == 0) {  /* Try preallocated pages. */
+    int olderr = errno;
+    p = (char *)mmap(NULL, size, PROT_READ|PROT_WRITE,
+		     MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    errno = olderr;
+    if (p != CMFAIL) {
+#if LJ_ALLOC_MMAP_PROBE
+      if (((uintptr_t)p >> LJ_ALLOC_MBITS) != 0) {
+	CALL_MUNMAP(p, size);
+      } else
+#endif
+      return p;
+    }
+  }
+#endif
+  p = (char *)CALL_MMAP(rs, size + LJ_HUGEPAGESIZE);
+  if (p == CMFAIL)
+    return CALL_MMAP(rs, size);
+  q = (char *)(((uintptr_t)p + LJ_HUGEPAGESIZE-1) &
+	       ~(uintptr_t)(LJ_HUGEPAGESIZE-1));
+  if (q != p) CALL_MUNMAP(p, (size_t)(q - p));
+  CALL_MUNMAP(q + size, LJ_HUGEPAGESIZE - (size_t)(q - p));
+#ifdef MADV_HUGEPAGE
+  {
+    int olderr = errno;
+    madvise(q, size, MADV_HUGEPAGE);  /* Ignore result. It's only a hint. */
+    errno = olderr;
+  }
+#endif
+  return q;
+}
+#define HUGE_MMAP(prng, size)	mmap_huge((prng), (size))
+#else
+#define HUGE_MMAP(prng, size)	CALL_MMAP((prng), (size))
+#endif
+
 /* -----------------------  Chunk representations ------------------------ */
 
 struct malloc_chunk {
@@ -515,6 +583,25 @@ struct malloc_segment {
 typedef struct malloc_segment  msegment;
 typedef struct malloc_segment *msegmentptr;
 
+/* ----------------------------- Slab spans ------------------------------ */
+
+/*
+** Blocks up to SLAB_MAXSIZE bytes are carved from spans of SLAB_SPAN bytes,
+** aligned to their size, with one free list per size class of 8 bytes.
+** There are no per-block headers. The caller passes the old size for
+** free and realloc, which tells slab blocks from dlmalloc chunks.
+*/
+typedef struct SlabSpan {
+  struct SlabSpan *next, *prev;	/* Spans of this class with free slots. */
+  struct SlabSpan *anext, *aprev;	/* List of all spans. */
+  void *free;		/* List of free slots. */
+  char *bump;		/* Start of slots that have never been used. */
+  uint32_t used;	/* Number of used slots. */
+  uint32_t size;	/* Slot size. */
+} SlabSpan;
+
+#define SLAB_CLASSES		(SLAB_MAXSIZE >> 3)
+
 /* ---------------------------- malloc_state ----------------------------- */
 
 /* Bin types, widths and sizes */
@@ -540,10 +627,46 @@ struct malloc_state {
   tbinptr    treebins[NTREEBINS];
   msegment   seg;
   PRNGState  *prng;
+  SlabSpan   *slab[SLAB_CLASSES+1];	/* Spans with free slots per class. */
+  SlabSpan   *slaball;	/* All spans. */
+  SlabSpan   *slabfree;	/* Cached empty spans. */
+  size_t     nslabfree;
+  int        slabmiss;	/* Small blocks were served by the arena. */
+#if LJ_HUGEPAGES || LJ_ALLOCSHARED
+  char       *slabregion;	/* Unused part of region for spans. */
+  size_t     slabregionsize;
+#endif
+  size_t     mapped;	/* Bytes mapped from the OS. */
+  size_t     hugemapped;	/* Part of it in huge page aligned regions. */
+#if LJ_ASYNCFREE
+  void       *defer;	/* Deferred frees, not yet handed to the helper. */
+  void       *defertail;
+  size_t     ndefer;
+  void       *pending;	/* Frees handed to the helper thread. */
+  void       *pendtail;
+  int        async;	/* Helper thread running: need to lock. */
+  int        stop;
+  pthread_t  thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
 };
 
 typedef struct malloc_state *mstate;
 
+/* Mapping statistics. Whole huge pages of huge page aligned regions count. */
+#if LJ_HUGEPAGES
+#define alloc_hugebytes(p, sz) \
+  (((uintptr_t)(p) & (LJ_HUGEPAGESIZE-1)) ? 0 : \
+   ((sz) & ~(size_t)(LJ_HUGEPAGESIZE-1)))
+#else
+#define alloc_hugebytes(p, sz)	0
+#endif
+#define alloc_mapped(m, p, sz) \
+  ((m)->mapped += (sz), (m)->hugemapped += alloc_hugebytes((p), (sz)))
+#define alloc_unmapped(m, p, sz) \
+  ((m)->mapped -= (sz), (m)->hugemapped -= alloc_hugebytes((p), (sz)))
+
 #define is_initialized(M)	((M)->top != 0)
 
 /* -------------------------- system alloc setup ------------------------- */
@@ -826,11 +949,12 @@ static void *direct_alloc(mstate m, size_t nb)
 {
   size_t mmsize = mmap_align(nb + SIX_SIZE_T_SIZES + CHUNK_ALIGN_MASK);
   if (LJ_LIKELY(mmsize > nb)) {     /* Check for wrap around 0 */
-    char *mm = (char *)(DIRECT_MMAP(m->prng, mmsize));
+    char *mm = (char *)(HUGE_MMAP(m->prng, mmsize));
     if (mm != CMFAIL) {
       size_t offset = align_offset(chunk2mem(mm));
       size_t psize = mmsize - offset - DIRECT_FOOT_PAD;
       mchunkptr p = (mchunkptr)(mm + offset);
+      alloc_mapped(m, mm, mmsize);
       p->prev_foot = offset | IS_DIRECT_BIT;
       p->head = psize|CINUSE_BIT;
       chunk_plus_offset(p, psize)->head = FENCEPOST_HEAD;
@@ -838,11 +962,10 @@ static void *direct_alloc(mstate m, size_t nb)
       return chunk2mem(p);
     }
   }
-  UNUSED(m);
   return NULL;
 }
 
-static mchunkptr direct_resize(mchunkptr oldp, size_t nb)
+static mchunkptr direct_resize(mstate m, mchunkptr oldp, size_t nb)
 {
   size_t oldsize = chunksize(oldp);
   if (is_small(nb)) /* Can't shrink direct regions below small size */
@@ -860,6 +983,8 @@ static mchunkptr direct_resize(mchunkptr oldp, size_t nb)
     if (cp != CMFAIL) {
       mchunkptr newp = (mchunkptr)(cp + offset);
       size_t psize = newmmsize - offset - DIRECT_FOOT_PAD;
+      alloc_unmapped(m, (char *)oldp - offset, oldmmsize);
+      alloc_mapped(m, cp, newmmsize);
       newp->head = psize|CINUSE_BIT;
       chunk_plus_offset(newp, psize)->head = FENCEPOST_HEAD;
       chunk_plus_offset(newp, psize+SIZE_T_SIZE)->head = 0;
@@ -996,8 +1121,9 @@ static void *alloc_sys(mstate m, size_t nb)
     size_t req = nb + TOP_FOOT_SIZE + SIZE_T_ONE;
     size_t rsize = granularity_align(req);
     if (LJ_LIKELY(rsize > nb)) { /* Fail if wraps around zero */
-      char *mp = (char *)(CALL_MMAP(m->prng, rsize));
+      char *mp = (char *)(HUGE_MMAP(m->prng, rsize));
       if (mp != CMFAIL) {
+	alloc_mapped(m, mp, rsize);
 	tbase = mp;
 	tsize = rsize;
       }
@@ -1066,6 +1192,7 @@ static size_t release_unused_segments(mstate m)
 	  unlink_large_chunk(m, tp);
 	}
 	if (CALL_MUNMAP(base, size) == 0) {
+	  alloc_unmapped(m, base, size);
 	  released += size;
 	  /* unlink obsoleted record */
 	  sp = pred;
@@ -1103,6 +1230,7 @@ static int alloc_trim(mstate m, size_t pad)
 	/* Prefer mremap, fall back to munmap */
 	if ((CALL_MREMAP(sp->base, sp->size, newsize, CALL_MREMAP_NOMOVE) != MFAIL) ||
 	    (CALL_MUNMAP(sp->base + newsize, extra) == 0)) {
+	  alloc_unmapped(m, sp->base + newsize, extra);
 	  released = extra;
 	}
       }
@@ -1221,15 +1349,224 @@ static void *tmalloc_small(mstate m, size_t nb)
   return chunk2mem(v);
 }
 
+/* ----------------------------- slab support ---------------------------- */
+
+#define slab_class(sz)	((sz) <= 16 ? 2 : ((sz) + 7) >> 3)
+#define slab_span(p)	((SlabSpan *)((uintptr_t)(p) & ~(uintptr_t)(SLAB_SPAN-1)))
+#define slab_isfull(sp) \
+  ((sp)->free == NULL && (sp)->bump + (sp)->size > (char *)(sp) + SLAB_SPAN)
+
+/* Map a new span, aligned to its size. */
+static SlabSpan *slab_mmap(mstate ms)
+{
+#if LJ_HUGEPAGES || LJ_ALLOCSHARED
+  /* Carve spans from larger regions. Empty spans are never unmapped. */
+  char *p;
+  if (ms->slabregionsize == 0) {
+    p = (char *)HUGE_MMAP(ms->prng, SLAB_REGION);
+    if (p == CMFAIL) return NULL;
+    if (((uintptr_t)p & (SLAB_SPAN-1))) {  /* Fallback mapping unaligned? */
+      CALL_MUNMAP(p, SLAB_REGION);
+      return NULL;
+    }
+    alloc_mapped(ms, p, SLAB_REGION);
+    ms->slabregion = p;
+    ms->slabregionsize = SLAB_REGION;
+  }
+  p = ms->slabregion;
+  ms->slabregion += SLAB_SPAN;
+  ms->slabregionsize -= SLAB_SPAN;
+#elif LJ_ALLOC_VIRTUALALLOC
+  /* VirtualAlloc returns memory aligned to the 64K allocation granularity. */
+  char *p = (char *)CALL_MMAP(ms->prng, SLAB_SPAN);
+#else
+  char *p = (char *)CALL_MMAP(ms->prng, 2*SLAB_SPAN);
+  if (p != CMFAIL) {  /* Trim to an aligned span. */
+    char *q = (char *)slab_span(p + SLAB_SPAN-1);
+    if (q != p) CALL_MUNMAP(p, (size_t)(q - p));
+    CALL_MUNMAP(q + SLAB_SPAN, SLAB_SPAN - (size_t)(q - p));
+    p = q;
+  }
+#endif
+  if (p == CMFAIL) return NULL;
+#if !(LJ_HUGEPAGES || LJ_ALLOCSHARED)
+  alloc_mapped(ms, p, SLAB_SPAN);
+#endif
+  return (SlabSpan *)p;
+}
+
+#if LJ_ALLOCSHARED
+/*
+** All states share one arena. Each state gets a handle with its own slab
+** lists, so the fast paths need no locking. Empty spans beyond SLAB_CACHE
+** go back to a shared pool. Larger blocks come from the shared arena.
+*/
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;
+static mstate shared_ms;	/* Shared arena. */
+static size_t shared_refs;	/* Number of handles. */
+static PRNGState shared_prng;
+
+/* Return a span to the shared pool. Lock must be held. */
+static void shared_poolspan(SlabSpan *sp)
+{
+  mstate sm = shared_ms;
+#if !LJ_HUGEPAGES && defined(MADV_DONTNEED)
+  if (sm->nslabfree >= SLAB_POOL) {  /* Release the pages of excess spans. */
+    int olderr = errno;
+    madvise(sp, SLAB_SPAN, MADV_DONTNEED);
+    errno = olderr;
+  }
+#endif
+  sp->next = sm->slabfree;
+  sm->slabfree = sp;
+  sm->nslabfree++;
+}
+
+static LJ_NOINLINE void shared_putspan(SlabSpan *sp)
+{
+  pthread_mutex_lock(&shared_lock);
+  shared_poolspan(sp);
+  pthread_mutex_unlock(&shared_lock);
+}
+
+static LJ_NOINLINE SlabSpan *shared_getspan(void)
+{
+  mstate sm;
+  SlabSpan *sp;
+  pthread_mutex_lock(&shared_lock);
+  sm = shared_ms;
+  if ((sp = sm->slabfree) != NULL) {
+    sm->slabfree = sp->next;
+    sm->nslabfree--;
+  } else {
+    sp = slab_mmap(sm);
+  }
+  pthread_mutex_unlock(&shared_lock);
+  return sp;
+}
+#endif
+
+/* Unlink span from the list of spans with free slots. */
+static void slab_unlink(mstate ms, SlabSpan *sp)
+{
+  if (sp->prev) sp->prev->next = sp->next;
+  else ms->slab[sp->size >> 3] = sp->next;
+  if (sp->next) sp->next->prev = sp->prev;
+}
+
+/* Get an empty span for a size class. */
+static LJ_NOINLINE SlabSpan *slab_newspan(mstate ms, size_t cls)
+{
+  SlabSpan *sp = ms->slabfree;
+  if (sp) {
+    ms->slabfree = sp->next;
+    ms->nslabfree--;
+  } else {
+#if LJ_ALLOCSHARED
+    sp = shared_getspan();
+#else
+    sp = slab_mmap(ms);
+#endif
+    if (!sp) return NULL;
+    sp->aprev = NULL;
+    sp->anext = ms->slaball;
+    if (ms->slaball) ms->slaball->aprev = sp;
+    ms->slaball = sp;
+  }
+  sp->free = NULL;
+  sp->bump = (char *)(sp + 1);
+  sp->used = 0;
+  sp->size = (uint32_t)(cls << 3);
+  sp->prev = NULL;
+  sp->next = ms->slab[cls];
+  if (sp->next) sp->next->prev = sp;
+  ms->slab[cls] = sp;
+  return sp;
+}
+
+/* Cache or unmap an empty span. */
+static LJ_NOINLINE void slab_freespan(mstate ms, SlabSpan *sp)
+{
+  slab_unlink(ms, sp);
+#if LJ_HUGEPAGES && !LJ_ALLOCSHARED
+  /* Spans carved from huge page regions can't be unmapped one by one.
+  ** Keep all of them, but release the pages of spans beyond SLAB_CACHE.
+  */
+#ifdef MADV_DONTNEED
+  if (ms->nslabfree >= SLAB_CACHE) {
+    SlabSpan hdr = *sp;  /* The header is still linked into slaball. */
+    int olderr = errno;
+    madvise(sp, SLAB_SPAN, MADV_DONTNEED);
+    errno = olderr;
+    *sp = hdr;
+  }
+#endif
+  sp->next = ms->slabfree;
+  ms->slabfree = sp;
+  ms->nslabfree++;
+#else
+  if (ms->nslabfree < SLAB_CACHE) {
+    sp->next = ms->slabfree;
+    ms->slabfree = sp;
+    ms->nslabfree++;
+  } else {
+    if (sp->aprev) sp->aprev->anext = sp->anext;
+    else ms->slaball = sp->anext;
+    if (sp->anext) sp->anext->aprev = sp->aprev;
+#if LJ_ALLOCSHARED
+    shared_putspan(sp);
+#else
+    CALL_MUNMAP(sp, SLAB_SPAN);
+    alloc_unmapped(ms, sp, SLAB_SPAN);
+#endif
+  }
+#endif
+}
+
+static LJ_AINLINE void *slab_alloc(mstate ms, size_t nsize)
+{
+  size_t cls = slab_class(nsize);
+  SlabSpan *sp = ms->slab[cls];
+  void *p;
+  if (LJ_UNLIKELY(!sp) && !(sp = slab_newspan(ms, cls)))
+    return NULL;
+  if ((p = sp->free) != NULL) {
+    sp->free = *(void **)p;
+  } else {
+    p = sp->bump;
+    sp->bump += sp->size;
+  }
+  sp->used++;
+  if (slab_isfull(sp))
+    slab_unlink(ms, sp);
+  return p;
+}
+
+static LJ_AINLINE void slab_free(mstate ms, void *p)
+{
+  SlabSpan *sp = slab_span(p);
+  if (slab_isfull(sp)) {  /* Add back to the list of spans with free slots. */
+    size_t cls = sp->size >> 3;
+    sp->prev = NULL;
+    sp->next = ms->slab[cls];
+    if (sp->next) sp->next->prev = sp;
+    ms->slab[cls] = sp;
+  }
+  *(void **)p = sp->free;
+  sp->free = p;
+  if (--sp->used == 0)
+    slab_freespan(ms, sp);
+}
+
 /* ----------------------------------------------------------------------- */
 
-void *lj_alloc_create(PRNGState *rs)
+static void *alloc_create(PRNGState *rs)
 {
   size_t tsize = DEFAULT_GRANULARITY;
   char *tbase;
   INIT_MMAP();
   UNUSED(rs);
-  tbase = (char *)(CALL_MMAP(rs, tsize));
+  tbase = (char *)(HUGE_MMAP(rs, tsize));
   if (tbase != CMFAIL) {
     size_t msize = pad_request(sizeof(struct malloc_state));
     mchunkptr mn;
@@ -1240,24 +1577,33 @@ void *lj_alloc_create(PRNGState *rs)
     m->seg.base = tbase;
     m->seg.size = tsize;
     m->release_checks = MAX_RELEASE_CHECK_RATE;
+    alloc_mapped(m, tbase, tsize);
     init_bins(m);
     mn = next_chunk(mem2chunk(m));
     init_top(m, mn, (size_t)((tbase + tsize) - (char *)mn) - TOP_FOOT_SIZE);
+#if LJ_ASYNCFREE
+    pthread_mutex_init(&m->lock, NULL);
+    pthread_cond_init(&m->cond, NULL);
+#endif
     return m;
   }
   return NULL;
 }
 
-void lj_alloc_setprng(void *msp, PRNGState *rs)
-{
-  mstate ms = (mstate)msp;
-  ms->prng = rs;
-}
-
-void lj_alloc_destroy(void *msp)
+/* Unmap all spans and segments. */
+static void alloc_unmap(mstate ms)
 {
-  mstate ms = (mstate)msp;
   msegmentptr sp = &ms->seg;
+  SlabSpan *ssp;
+#if LJ_HUGEPAGES || LJ_ALLOCSHARED
+  if (ms->slabregionsize)
+    CALL_MUNMAP(ms->slabregion, ms->slabregionsize);
+#endif
+  for (ssp = ms->slaball; ssp != NULL; ) {
+    SlabSpan *next = ssp->anext;
+    CALL_MUNMAP(ssp, SLAB_SPAN);
+    ssp = next;
+  }
   while (sp != 0) {
     char *base = sp->base;
     size_t size = sp->size;
@@ -1266,6 +1612,43 @@ void lj_alloc_destroy(void *msp)
   }
 }
 
+#if !LJ_ALLOCSHARED
+void *lj_alloc_create(PRNGState *rs)
+{
+  return alloc_create(rs);
+}
+
+void lj_alloc_meminfo(void *msp, size_t *mapped, size_t *hugemapped)
+{
+  mstate ms = (mstate)msp;
+  *mapped = ms->mapped;
+  *hugemapped = ms->hugemapped;
+}
+
+void lj_alloc_destroy(void *msp)
+{
+  mstate ms = (mstate)msp;
+#if LJ_ASYNCFREE
+  if (ms->async) {  /* Stop the helper thread before unmapping everything. */
+    pthread_mutex_lock(&ms->lock);
+    ms->stop = 1;
+    pthread_cond_signal(&ms->cond);
+    pthread_mutex_unlock(&ms->lock);
+    pthread_join(ms->thread, NULL);
+  }
+  pthread_cond_destroy(&ms->cond);
+  pthread_mutex_destroy(&ms->lock);
+#endif
+  alloc_unmap(ms);
+}
+#endif
+
+void lj_alloc_setprng(void *msp, PRNGState *rs)
+{
+  mstate ms = (mstate)msp;
+  ms->prng = rs;
+}
+
 static LJ_NOINLINE void *lj_alloc_malloc(void *msp, size_t nsize)
 {
   mstate ms = (mstate)msp;
@@ -1362,6 +1745,7 @@ static LJ_NOINLINE void *lj_alloc_free(void *msp, void *ptr)
 	prevsize &= ~IS_DIRECT_BIT;
 	psize += prevsize + DIRECT_FOOT_PAD;
 	CALL_MUNMAP((char *)p - prevsize, psize);
+	alloc_unmapped(fm, (char *)p - prevsize, psize);
 	return NULL;
       } else {
 	mchunkptr prev = chunk_minus_offset(p, prevsize);
@@ -1434,7 +1818,7 @@ static LJ_NOINLINE void *lj_alloc_realloc(void *msp, void *ptr, size_t nsize)
 
     /* Try to either shrink or extend into top. Else malloc-copy-free */
     if (is_direct(oldp)) {
-      newp = direct_resize(oldp, nb);  /* this may return NULL. */
+      newp = direct_resize(m, oldp, nb);  /* this may return NULL. */
     } else if (oldsize >= nb) { /* already big enough */
       size_t rsize = oldsize - nb;
       newp = oldp;
@@ -1470,16 +1854,256 @@ static LJ_NOINLINE void *lj_alloc_realloc(void *msp, void *ptr, size_t nsize)
   }
 }
 
-void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize)
+#if LJ_ALLOCSHARED
+/* Blocks not served by the slabs of a handle come from the shared arena. */
+static LJ_NOINLINE void *shared_malloc(size_t nsize)
+{
+  void *p;
+  pthread_mutex_lock(&shared_lock);
+  p = lj_alloc_malloc(shared_ms, nsize);
+  pthread_mutex_unlock(&shared_lock);
+  return p;
+}
+
+static LJ_NOINLINE void *shared_free(void *ptr)
+{
+  if (ptr != 0) {
+    pthread_mutex_lock(&shared_lock);
+    lj_alloc_free(shared_ms, ptr);
+    pthread_mutex_unlock(&shared_lock);
+  }
+  return NULL;
+}
+
+static LJ_NOINLINE void *shared_realloc(void *ptr, size_t nsize)
+{
+  void *p;
+  pthread_mutex_lock(&shared_lock);
+  p = lj_alloc_realloc(shared_ms, ptr, nsize);
+  pthread_mutex_unlock(&shared_lock);
+  return p;
+}
+
+static LJ_NOINLINE int shared_holds(void *ptr)
+{
+  msegmentptr sp;
+  pthread_mutex_lock(&shared_lock);
+  sp = segment_holding(shared_ms, (char *)ptr);
+  pthread_mutex_unlock(&shared_lock);
+  return sp != 0;
+}
+
+#define alloc_malloc(msp, nsize)	shared_malloc((nsize))
+#define alloc_large_free(msp, ptr)	shared_free((ptr))
+#define alloc_realloc(msp, ptr, nsize)	shared_realloc((ptr), (nsize))
+#define alloc_holds(msp, ptr)		shared_holds((ptr))
+#else
+#define alloc_malloc(msp, nsize)	lj_alloc_malloc((msp), (nsize))
+#define alloc_large_free(msp, ptr)	lj_alloc_free((msp), (ptr))
+#define alloc_realloc(msp, ptr, nsize)	lj_alloc_realloc((msp), (ptr), (nsize))
+#define alloc_holds(msp, ptr) \
+  (segment_holding((mstate)(msp), (char *)(ptr)) != 0)
+#endif
+
+/* Serve a small block from the arena if no slab span can be mapped.
+** Slab spans are never part of an arena segment, so alloc_free() can
+** tell these blocks apart by their address.
+*/
+static LJ_NOINLINE void *alloc_slabmiss(void *msp, size_t nsize)
+{
+  ((mstate)msp)->slabmiss = 1;
+  return alloc_malloc(msp, nsize);
+}
+
+static LJ_AINLINE void *alloc_small(void *msp, size_t nsize)
+{
+  void *p = slab_alloc((mstate)msp, nsize);
+  return LJ_LIKELY(p != NULL) ? p : alloc_slabmiss(msp, nsize);
+}
+
+static LJ_AINLINE void *alloc_free(void *msp, void *ptr, size_t osize)
+{
+  if (osize <= SLAB_MAXSIZE && ptr != NULL &&
+      LJ_LIKELY(!((mstate)msp)->slabmiss || !alloc_holds(msp, ptr))) {
+    slab_free((mstate)msp, ptr);
+    return NULL;
+  }
+  return alloc_large_free(msp, ptr);
+}
+
+static LJ_AINLINE void *alloc_f(void *msp, void *ptr, size_t osize,
+				size_t nsize)
 {
-  (void)osize;
   if (nsize == 0) {
-    return lj_alloc_free(msp, ptr);
+    return alloc_free(msp, ptr, osize);
   } else if (ptr == NULL) {
-    return lj_alloc_malloc(msp, nsize);
+    if (nsize <= SLAB_MAXSIZE)
+      return alloc_small(msp, nsize);
+    return alloc_malloc(msp, nsize);
+  } else if (osize <= SLAB_MAXSIZE || nsize <= SLAB_MAXSIZE) {
+    void *nptr;
+    if (osize <= SLAB_MAXSIZE && nsize <= SLAB_MAXSIZE &&
+	slab_class(osize) == slab_class(nsize))
+      return ptr;  /* Same size class. */
+    nptr = nsize <= SLAB_MAXSIZE ? alloc_small(msp, nsize) :
+				   alloc_malloc(msp, nsize);
+    if (nptr) {
+      memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+      alloc_free(msp, ptr, osize);
+    }
+    return nptr;
   } else {
-    return lj_alloc_realloc(msp, ptr, nsize);
+    return alloc_realloc(msp, ptr, nsize);
+  }
+}
+
+void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize)
+{
+#if LJ_ASYNCFREE
+  if (LJ_UNLIKELY(((mstate)msp)->async)) {
+    mstate ms = (mstate)msp;
+    void *p;
+    pthread_mutex_lock(&ms->lock);
+    p = alloc_f(msp, ptr, osize, nsize);
+    pthread_mutex_unlock(&ms->lock);
+    return p;
   }
+#endif
+  return alloc_f(msp, ptr, osize, nsize);
 }
 
+#if LJ_ALLOCSHARED
+void *lj_alloc_create(PRNGState *rs)
+{
+  mstate ms = NULL;
+  pthread_mutex_lock(&shared_lock);
+  if (!shared_ms) {  /* Create shared arena for the first handle. */
+    shared_prng = *rs;
+    shared_ms = (mstate)alloc_create(&shared_prng);
+    if (shared_ms) shared_ms->prng = &shared_prng;
+  }
+  if (shared_ms) {
+    ms = (mstate)lj_alloc_malloc(shared_ms, sizeof(struct malloc_state));
+    if (ms) {
+      memset(ms, 0, sizeof(struct malloc_state));
+      ms->prng = &shared_prng;
+      shared_refs++;
+    } else if (shared_refs == 0) {
+      alloc_unmap(shared_ms);
+      shared_ms = NULL;
+    }
+  }
+  pthread_mutex_unlock(&shared_lock);
+  return ms;
+}
+
+void lj_alloc_meminfo(void *msp, size_t *mapped, size_t *hugemapped)
+{
+  UNUSED(msp);
+  pthread_mutex_lock(&shared_lock);
+  *mapped = shared_ms->mapped;
+  *hugemapped = shared_ms->hugemapped;
+  pthread_mutex_unlock(&shared_lock);
+}
+
+/* Return the spans of a handle to the shared pool and drop the handle. */
+void lj_alloc_destroy(void *msp)
+{
+  mstate ms = (mstate)msp;
+  SlabSpan *sp;
+  pthread_mutex_lock(&shared_lock);
+  for (sp = ms->slaball; sp != NULL; ) {
+    SlabSpan *next = sp->anext;
+    shared_poolspan(sp);
+    sp = next;
+  }
+  lj_alloc_free(shared_ms, ms);
+  if (--shared_refs == 0) {  /* Last handle gone: unmap everything. */
+    for (sp = shared_ms->slabfree; sp != NULL; ) {
+      SlabSpan *next = sp->next;
+      CALL_MUNMAP(sp, SLAB_SPAN);
+      sp = next;
+    }
+    shared_ms->slabfree = NULL;
+    alloc_unmap(shared_ms);
+    shared_ms = NULL;
+  }
+  pthread_mutex_unlock(&shared_lock);
+}
+#endif
+
+#if LJ_ASYNCFREE
+/* Helper thread: release the memory handed over by lj_alloc_flushdefer. */
+static void *alloc_freethread(void *msp)
+{
+  mstate ms = (mstate)msp;
+  pthread_mutex_lock(&ms->lock);
+  while (!ms->stop) {
+    void *p = ms->pending;
+    if (p) {
+      int n;
+      for (n = 0; p && n < ALLOC_FREE_BATCH; n++) {
+	void *next = *(void **)p;
+	alloc_free(ms, p, ((size_t *)p)[1]);
+	p = next;
+      }
+      ms->pending = p;
+      if (!p) ms->pendtail = NULL;
+      pthread_mutex_unlock(&ms->lock);  /* Let the main thread in. */
+      pthread_mutex_lock(&ms->lock);
+    } else {
+      pthread_cond_wait(&ms->cond, &ms->lock);
+    }
+  }
+  pthread_mutex_unlock(&ms->lock);
+  return NULL;
+}
+
+/* Hand deferred frees over to the helper thread. */
+void lj_alloc_flushdefer(void *msp)
+{
+  mstate ms = (mstate)msp;
+  void *p = ms->defer, *tail = ms->defertail;
+  if (!p) return;
+  ms->defer = ms->defertail = NULL;
+  ms->ndefer = 0;
+  if (!ms->async) {  /* Start helper thread on first use. */
+    if (pthread_create(&ms->thread, NULL, alloc_freethread, ms) == 0) {
+      ms->async = 1;
+    } else {  /* Otherwise free synchronously. */
+      while (p) {
+	void *next = *(void **)p;
+	alloc_free(ms, p, ((size_t *)p)[1]);
+	p = next;
+      }
+      return;
+    }
+  }
+  pthread_mutex_lock(&ms->lock);
+  if (ms->pendtail)
+    *(void **)ms->pendtail = p;
+  else
+    ms->pending = p;
+  ms->pendtail = tail;
+  pthread_cond_signal(&ms->cond);
+  pthread_mutex_unlock(&ms->lock);
+}
+
+/* Allocator variant used during sweeping. Frees are only queued. */
+void *lj_alloc_fdefer(void *msp, void *ptr, size_t osize, size_t nsize)
+{
+  mstate ms = (mstate)msp;
+  if (nsize == 0 && ptr != NULL) {
+    *(void **)ptr = ms->defer;
+    ((size_t *)ptr)[1] = osize;  /* Blocks have room for at least 2 words. */
+    if (!ms->defer) ms->defertail = ptr;
+    ms->defer = ptr;
+    if (++ms->ndefer >= ALLOC_DEFER_MAX)
+      lj_alloc_flushdefer(msp);
+    return NULL;
+  }
+  return lj_alloc_f(msp, ptr, osize, nsize);
+}
+#endif
+
 #endif
@@ -11,8 +11,14 @@
 #ifndef LUAJIT_USE_SYSMALLOC
 LJ_FUNC void *lj_alloc_create(PRNGState *rs);
 LJ_FUNC void lj_alloc_setprng(void *msp, PRNGState *rs);
+LJ_FUNC void lj_alloc_meminfo(void *msp, size_t *mapped, size_t *hugemapped);
 LJ_FUNC void lj_alloc_destroy(void *msp);
 LJ_FUNC void *lj_alloc_f(void *msp, void *ptr, size_t osize, size_t nsize);
+#if LJ_ASYNCFREE
+LJ_FUNC void *lj_alloc_fdefer(void *msp, void *ptr, size_t osize,
+			      size_t nsize);
+LJ_FUNC void lj_alloc_flushdefer(void *msp);
+#endif
 #endif
 
 #endif
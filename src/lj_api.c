@@ -1296,6 +1296,17 @@ LUA_API int lua_gc(lua_State *L, int what, int data)
   case LUA_GCISRUNNING:
     res = (g->gc.threshold != LJ_MAX_MEM);
     break;
+  case LUA_GCGEN:
+  case LUA_GCINC:
+    res = g->gc.genmode ? LUA_GCGEN : LUA_GCINC;
+    g->gc.genmode = (what == LUA_GCGEN);
+    if (!g->gc.genmode && g->gc.sticky)
+      lj_gc_fullgc(L);  /* Drop the old generation. */
+    break;
+  case LUA_GCSETPAUSETARGET:
+    res = (int)(g->gc.pausetarget);
+    g->gc.pausetarget = data > 0 ? (MSize)data : 0;
+    break;
   default:
     res = -1;  /* Invalid option. */
   }
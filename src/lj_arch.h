@@ -646,6 +646,29 @@
 #define LJ_HASPROFILE		0
 #endif
 
+/* Back the heap and the mcode areas with huge pages. */
+#if defined(LUAJIT_USE_HUGEPAGES) && LJ_TARGET_LINUX
+#define LJ_HUGEPAGES		1
+#else
+#define LJ_HUGEPAGES		0
+#endif
+
+/* Share one allocator arena between all states (bundled allocator only). */
+#if defined(LUAJIT_USE_SHAREDALLOC) && !defined(LUAJIT_USE_SYSMALLOC) && \
+    LJ_TARGET_POSIX
+#define LJ_ALLOCSHARED		1
+#else
+#define LJ_ALLOCSHARED		0
+#endif
+
+/* Release swept memory on a helper thread (bundled allocator only). */
+#if defined(LUAJIT_USE_ASYNCFREE) && !defined(LUAJIT_USE_SYSMALLOC) && \
+    LJ_TARGET_POSIX && !LJ_ALLOCSHARED
+#define LJ_ASYNCFREE		1
+#else
+#define LJ_ASYNCFREE		0
+#endif
+
 #ifndef LJ_ARCH_HASFPU
 #define LJ_ARCH_HASFPU		1
 #endif
@@ -686,6 +709,9 @@
 #ifndef LJ_PAGESIZE
 #define LJ_PAGESIZE		4096
 #endif
+#ifndef LJ_HUGEPAGESIZE
+#define LJ_HUGEPAGESIZE		0x200000
+#endif
 
 /* Various workarounds for embedded operating systems or weak C runtimes. */
 #if defined(__ANDROID__) || defined(__symbian__) || LJ_TARGET_XBOX360 || LJ_TARGET_WINDOWS
@@ -12,8 +12,19 @@
 #include "lj_buf.h"
 #include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_udata.h"
 #include "lj_strfmt.h"
 
+#if LJ_HASBUFFER
+#include <errno.h>
+#if LJ_TARGET_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#endif
+
 /* -- Buffer management --------------------------------------------------- */
 
 static void buf_grow(SBuf *sb, MSize sz)
@@ -127,6 +138,95 @@ MSize LJ_FASTCALL lj_bufx_more(SBufExt *sbx, MSize sz)
 #endif
 #endif
 
+/* -- Memory-mapped files ------------------------------------------------- */
+
+#if LJ_HASBUFFER
+/* Payload of a UDTYPE_MMAP userdata, which owns the mapping. */
+typedef struct BufMap {
+  void *p;		/* Start of mapping or NULL. */
+  size_t sz;		/* Size of mapping. */
+} BufMap;
+
+/* Map a file and set the buffer to a copy-on-write view of it.
+** Returns 0 and sets errno on failure.
+*/
+int lj_bufx_map(SBufExt *sbx, GCtab *env, const char *path, int writable,
+		uint64_t ofs, uint64_t len)
+{
+  lua_State *L = sbufL(sbx);
+  GCudata *ud = lj_udata_new(L, sizeof(BufMap), env);
+  BufMap *m = (BufMap *)uddata(ud);
+  char *p = NULL;
+  m->p = NULL; m->sz = 0;
+  ud->udtype = UDTYPE_MMAP;
+#if LJ_TARGET_POSIX
+  {
+    struct stat st;
+    uint64_t fsz, pofs;
+    int fd = open(path, writable ? O_RDWR : O_RDONLY);
+    if (fd < 0) return 0;
+    if (fstat(fd, &st) < 0) goto fail;
+    fsz = (uint64_t)st.st_size;
+    if (ofs > fsz) { errno = EINVAL; goto fail; }
+    if (len > fsz - ofs) len = fsz - ofs;
+    if (len >= LJ_MAX_BUF) { errno = EFBIG; goto fail; }
+    if (len) {
+      pofs = ofs & ~(uint64_t)(sysconf(_SC_PAGESIZE) - 1);
+      m->sz = (size_t)(len + (ofs - pofs));
+      m->p = mmap(NULL, m->sz, writable ? PROT_READ|PROT_WRITE : PROT_READ,
+		  MAP_SHARED, fd, (off_t)pofs);
+      if (m->p == MAP_FAILED) { m->p = NULL; m->sz = 0; goto fail; }
+      p = (char *)m->p + (ofs - pofs);
+    }
+    close(fd);
+    goto ok;
+  fail:
+    { int err = errno; close(fd); errno = err; }
+    return 0;
+  }
+ok:
+#else
+  UNUSED(path); UNUSED(writable); UNUSED(ofs);
+  errno = ENOSYS;
+  return 0;
+#endif
+  lj_bufx_free(L, sbx);
+  if (len) {
+    lj_bufx_set_cow(L, sbx, p, (MSize)len);
+    setgcref(sbx->cowref, obj2gco(ud));
+    lj_gc_objbarrier(L, (GCudata *)sbx - 1, ud);
+  }
+  return 1;
+}
+
+/* Flush the mapping of a buffer to its file. Returns 0 on failure. */
+int lj_bufx_sync(SBufExt *sbx)
+{
+  GCobj *o = gcref(sbx->cowref);
+  if (sbufiscow(sbx) && o && o->gch.gct == ~LJ_TUDATA &&
+      gco2ud(o)->udtype == UDTYPE_MMAP) {
+    BufMap *m = (BufMap *)uddata(gco2ud(o));
+#if LJ_TARGET_POSIX
+    if (m->p && msync(m->p, m->sz, MS_SYNC) < 0)
+      return 0;
+#else
+    UNUSED(m);
+#endif
+  }
+  return 1;
+}
+
+/* Unmap the file owned by a UDTYPE_MMAP userdata. */
+void LJ_FASTCALL lj_bufx_unmap(GCudata *ud)
+{
+  BufMap *m = (BufMap *)uddata(ud);
+#if LJ_TARGET_POSIX
+  if (m->p) munmap(m->p, m->sz);
+#endif
+  m->p = NULL;
+}
+#endif
+
 /* -- Low-level buffer put operations ------------------------------------- */
 
 SBuf *lj_buf_putmem(SBuf *sb, const void *q, MSize len)
@@ -180,11 +280,25 @@ SBuf * LJ_FASTCALL lj_buf_putstr_reverse(SBuf *sb, GCstr *s)
   return sb;
 }
 
+/* Flag bit 7 of all ASCII bytes in [lo, hi] of a 64 bit word. */
+static LJ_AINLINE uint64_t buf_rangemask(uint64_t x, uint32_t lo, uint32_t hi)
+{
+  uint64_t h = x & U64x(7f7f7f7f,7f7f7f7f);
+  uint64_t l = U64x(01010101,01010101);
+  return (h + l*(0x80-lo)) & ~(h + l*(0x7f-hi)) & ~x & U64x(80808080,80808080);
+}
+
 SBuf * LJ_FASTCALL lj_buf_putstr_lower(SBuf *sb, GCstr *s)
 {
   MSize len = s->len;
   char *w = lj_buf_more(sb, len), *e = w+len;
   const char *q = strdata(s);
+  for (; w+8 <= e; w += 8, q += 8) {  /* 8 bytes at a time. */
+    uint64_t x;
+    memcpy(&x, q, 8);
+    x |= buf_rangemask(x, 'A', 'Z') >> 2;
+    memcpy(w, &x, 8);
+  }
   for (; w < e; w++, q++) {
     uint32_t c = *(unsigned char *)q;
 #if LJ_TARGET_PPC
@@ -203,6 +317,12 @@ SBuf * LJ_FASTCALL lj_buf_putstr_upper(SBuf *sb, GCstr *s)
   MSize len = s->len;
   char *w = lj_buf_more(sb, len), *e = w+len;
   const char *q = strdata(s);
+  for (; w+8 <= e; w += 8, q += 8) {  /* 8 bytes at a time. */
+    uint64_t x;
+    memcpy(&x, q, 8);
+    x &= ~(buf_rangemask(x, 'a', 'z') >> 2);
+    memcpy(w, &x, 8);
+  }
   for (; w < e; w++, q++) {
     uint32_t c = *(unsigned char *)q;
 #if LJ_TARGET_PPC
@@ -216,6 +336,30 @@ SBuf * LJ_FASTCALL lj_buf_putstr_upper(SBuf *sb, GCstr *s)
   return sb;
 }
 
+/* Append a code point (< 0x110000) in UTF-8 encoding. */
+SBuf * LJ_FASTCALL lj_buf_pututf8(SBuf *sb, uint32_t c)
+{
+  char *w = lj_buf_more(sb, 4);
+  if (c < 0x80) {
+    *w++ = (char)c;
+  } else {
+    if (c < 0x800) {
+      *w++ = (char)(0xc0 | (c >> 6));
+    } else {
+      if (c < 0x10000) {
+	*w++ = (char)(0xe0 | (c >> 12));
+      } else {
+	*w++ = (char)(0xf0 | (c >> 18));
+	*w++ = (char)(0x80 | ((c >> 12) & 0x3f));
+      }
+      *w++ = (char)(0x80 | ((c >> 6) & 0x3f));
+    }
+    *w++ = (char)(0x80 | (c & 0x3f));
+  }
+  sb->w = w;
+  return sb;
+}
+
 SBuf *lj_buf_putstr_rep(SBuf *sb, GCstr *s, int32_t rep)
 {
   MSize len = s->len;
@@ -30,6 +30,12 @@ typedef struct SBufExt {
   GCRef dict_str;	/* Serialization string dictionary table. */
   GCRef dict_mt;	/* Serialization metatable dictionary table. */
   int depth;		/* Remaining recursion depth. */
+  GCRef dict_obj;	/* Snapshot object dictionary table. */
+  GCRef refs;		/* Snapshot reference table (only while in use). */
+  uint32_t nref;	/* Number of snapshot references. */
+  MSize lazystr;	/* Min. length of strings decoded as views or 0. */
+  TValue jnull;		/* JSON null sentinel. */
+  MSize jmark;		/* Write offset to restore if JSON encoding fails. */
 } SBufExt;
 
 #define sbufsz(sb)		((MSize)((sb)->e - (sb)->b))
@@ -158,6 +164,13 @@ LJ_FUNC MSize LJ_FASTCALL lj_bufx_more(SBufExt *sbx, MSize sz);
 #endif
 #endif
 
+#if LJ_HASBUFFER
+LJ_FUNC int lj_bufx_map(SBufExt *sbx, GCtab *env, const char *path,
+			int writable, uint64_t ofs, uint64_t len);
+LJ_FUNC int lj_bufx_sync(SBufExt *sbx);
+LJ_FUNC void LJ_FASTCALL lj_bufx_unmap(GCudata *ud);
+#endif
+
 /* Low-level buffer put operations */
 LJ_FUNC SBuf *lj_buf_putmem(SBuf *sb, const void *q, MSize len);
 #if LJ_HASJIT || LJ_HASFFI
@@ -181,6 +194,7 @@ static LJ_AINLINE void lj_buf_putb(SBuf *sb, int c)
 LJ_FUNCA SBuf * LJ_FASTCALL lj_buf_putstr_reverse(SBuf *sb, GCstr *s);
 LJ_FUNCA SBuf * LJ_FASTCALL lj_buf_putstr_lower(SBuf *sb, GCstr *s);
 LJ_FUNCA SBuf * LJ_FASTCALL lj_buf_putstr_upper(SBuf *sb, GCstr *s);
+LJ_FUNC SBuf * LJ_FASTCALL lj_buf_pututf8(SBuf *sb, uint32_t c);
 LJ_FUNC SBuf *lj_buf_putstr_rep(SBuf *sb, GCstr *s, int32_t rep);
 LJ_FUNC SBuf *lj_buf_puttab(SBuf *sb, GCtab *t, GCstr *sep,
 			    int32_t i, int32_t e);
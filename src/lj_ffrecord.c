@@ -985,24 +985,50 @@ static void LJ_FASTCALL recff_string_find(jit_State *J, RecordFFData *rd)
   }
 }
 
+#if LJ_HASBUFFER
+static LJ_AINLINE TRef recff_sbufx_get_ptr(jit_State *J, TRef ud, IRFieldID fl)
+{
+  return emitir(IRT(IR_FLOAD, IRT_PTR), ud, fl);
+}
+
+static LJ_AINLINE TRef recff_sbufx_len(jit_State *J, TRef trr, TRef trw)
+{
+  TRef len = emitir(IRT(IR_SUB, IRT_INTP), trw, trr);
+  if (LJ_64)
+    len = emitir(IRTI(IR_CONV), len, (IRT_INT<<5)|IRT_INTP|IRCONV_NONE);
+  return len;
+}
+
+/* Emit typecheck for string buffer. */
+static TRef recff_sbufx_check(jit_State *J, RecordFFData *rd, ptrdiff_t arg)
+{
+  TRef trtype, ud = J->base[arg];
+  if (!tvisbuf(&rd->argv[arg])) lj_trace_err(J, LJ_TRERR_BADTYPE);
+  trtype = emitir(IRT(IR_FLOAD, IRT_U8), ud, IRFL_UDATA_UDTYPE);
+  emitir(IRTGI(IR_EQ), trtype, lj_ir_kint(J, UDTYPE_BUFFER));
+  J->needsnap = 1;
+  return ud;
+}
+#endif
+
 static void recff_format(jit_State *J, RecordFFData *rd, TRef hdr, int sbufx)
 {
   ptrdiff_t arg = sbufx;
   TRef tr = hdr, trfmt = lj_ir_tostr(J, J->base[arg]);
   GCstr *fmt = argv2str(J, &rd->argv[arg]);
-  FormatState fs;
+  const SFormatOp *op = strfmt_ops(lj_strfmt_compile(J->L, fmt));
   SFormat sf;
   /* Specialize to the format string. */
   emitir(IRTG(IR_EQ, IRT_STR), trfmt, lj_ir_kstr(J, fmt));
-  lj_strfmt_init(&fs, strdata(fmt), fmt->len);
-  while ((sf = lj_strfmt_parse(&fs)) != STRFMT_EOF) {  /* Parse format. */
+  for (; (sf = op->sf) != STRFMT_EOF; op++) {
     TRef tra = sf == STRFMT_LIT ? 0 : J->base[++arg];
     TRef trsf = lj_ir_kint(J, (int32_t)sf);
     IRCallID id;
+    if (!tra && sf != STRFMT_LIT) goto nyi;  /* Interpreter throws. */
     switch (STRFMT_TYPE(sf)) {
     case STRFMT_LIT:
-      tr = emitir(IRTG(IR_BUFPUT, IRT_PGC), tr,
-		  lj_ir_kstr(J, lj_str_new(J->L, fs.str, fs.len)));
+      tra = lj_ir_kstr(J, lj_str_new(J->L, strdata(fmt)+op->ofs, op->len));
+      tr = emitir(IRTG(IR_BUFPUT, IRT_PGC), tr, tra);
       break;
     case STRFMT_INT:
       id = IRCALL_lj_strfmt_putfnum_int;
@@ -1043,10 +1069,37 @@ static void recff_format(jit_State *J, RecordFFData *rd, TRef hdr, int sbufx)
       if (LJ_SOFTFP32) lj_needsplit(J);
       break;
     case STRFMT_STR:
-      if (!tref_isstr(tra)) {
-	recff_nyiu(J, rd);  /* NYI: __tostring and non-string types for %s. */
-	/* NYI: also buffers. */
-	return;
+#if LJ_HASBUFFER
+      if (tref_isudata(tra) && sf == STRFMT_STR) {  /* Plain %s of buffer. */
+	TRef trr, trw;
+	if (!tvisbuf(&rd->argv[arg])) goto nyi;
+	tra = recff_sbufx_check(J, rd, arg);
+	if (sbufx)  /* Interpreter throws for self-formatting. */
+	  emitir(IRTG(IR_NE, IRT_PGC), J->base[0], tra);
+	trr = recff_sbufx_get_ptr(J, tra, IRFL_SBUF_R);
+	trw = recff_sbufx_get_ptr(J, tra, IRFL_SBUF_W);
+	tr = lj_ir_call(J, IRCALL_lj_buf_putmem, tr, trr,
+			recff_sbufx_len(J, trr, trw));
+	break;
+      }
+#endif
+      if (tref_isnumber(tra) || tref_ispri(tra)) {
+	RecordIndex ix;
+	ix.tab = tra;
+	copyTV(J->L, &ix.tabv, &rd->argv[arg]);
+	/* NYI: __tostring for %s. A metamethod can only be recorded as a
+	** tailcall (see recff_metacall), which has no way to resume the
+	** rest of the format afterwards.
+	*/
+	if (lj_record_mm_lookup(J, &ix, MM_tostring))
+	  goto nyi;
+	if (tref_isnumber(tra))
+	  tra = emitir(IRT(IR_TOSTR, IRT_STR), tra,
+		       tref_isnum(tra) ? IRTOSTR_NUM : IRTOSTR_INT);
+	else
+	  tra = lj_ir_kstr(J, lj_strfmt_obj(J->L, &rd->argv[arg]));
+      } else if (!tref_isstr(tra)) {
+	goto nyi;  /* NYI: __tostring and other types for %s. */
       }
       if (sf == STRFMT_STR)  /* Shortcut for plain %s. */
 	tr = emitir(IRTG(IR_BUFPUT, IRT_PGC), tr, tra);
@@ -1063,9 +1116,24 @@ static void recff_format(jit_State *J, RecordFFData *rd, TRef hdr, int sbufx)
       else
 	tr = lj_ir_call(J, IRCALL_lj_strfmt_putfchar, tr, trsf, tra);
       break;
-    case STRFMT_PTR:  /* NYI */
+    case STRFMT_PTR:  /* No formatting. */
+      if (tref_isudata(tra))
+	tra = emitir(IRT(IR_ADD, IRT_PGC), tra,
+		     lj_ir_kintpgc(J, sizeof(GCudata)));
+#if LJ_HASFFI
+      else if (tref_iscdata(tra))
+	tra = emitir(IRT(IR_ADD, IRT_PGC), tra,
+		     lj_ir_kintpgc(J, sizeof(GCcdata)));
+#endif
+      else if (tref_isnumber(tra) || tref_ispri(tra))
+	tra = lj_ir_kptr(J, NULL);
+      else if (!tref_isgcv(tra))
+	goto nyi;  /* NYI: light userdata. */
+      tr = lj_ir_call(J, IRCALL_lj_strfmt_putptr, tr, tra);
+      break;
     case STRFMT_ERR:
     default:
+    nyi:
       recff_nyiu(J, rd);
       return;
     }
@@ -1082,6 +1150,38 @@ static void LJ_FASTCALL recff_string_format(jit_State *J, RecordFFData *rd)
   recff_format(J, rd, recff_bufhdr(J), 0);
 }
 
+/* -- UTF-8 library fast functions ---------------------------------------- */
+
+static void LJ_FASTCALL recff_utf8_len(jit_State *J, RecordFFData *rd)
+{
+  if (tref_isnil(J->base[1]) && tref_isnil(J->base[2])) {
+    TRef tr = lj_ir_tostr(J, J->base[0]);
+    if (lj_str_utf8len(argv2str(J, &rd->argv[0])) >= 0) {
+      /* Specialize to valid UTF-8. Invalid strings exit the trace. */
+      tr = lj_ir_call(J, IRCALL_lj_str_utf8len, tr);
+      emitir(IRTGI(IR_GE), tr, lj_ir_kint(J, 0));
+      J->base[0] = tr;
+      return;
+    }
+  }
+  recff_nyiu(J, rd);
+}
+
+static void LJ_FASTCALL recff_utf8_char(jit_State *J, RecordFFData *rd)
+{
+  TRef kmax = lj_ir_kint(J, 0x10ffff);
+  TRef hdr = recff_bufhdr(J), tr = hdr;
+  BCReg i;
+  for (i = 0; J->base[i] != 0; i++) {
+    TRef trc = lj_opt_narrow_toint(J, J->base[i]);
+    emitir(IRTGI(IR_ULE), trc, kmax);
+    tr = lj_ir_call(J, IRCALL_lj_buf_pututf8, tr, trc);
+  }
+  J->base[0] = i ? emitir(IRTG(IR_BUFSTR, IRT_STR), tr, hdr) :
+		   lj_ir_kstr(J, &J2G(J)->strempty);
+  UNUSED(rd);
+}
+
 /* -- Buffer library fast functions --------------------------------------- */
 
 #if LJ_HASBUFFER
@@ -1097,36 +1197,12 @@ static LJ_AINLINE void recff_sbufx_set_L(jit_State *J, TRef ud, TRef val)
   emitir(IRT(IR_FSTORE, IRT_PGC), fref, val);
 }
 
-static LJ_AINLINE TRef recff_sbufx_get_ptr(jit_State *J, TRef ud, IRFieldID fl)
-{
-  return emitir(IRT(IR_FLOAD, IRT_PTR), ud, fl);
-}
-
 static LJ_AINLINE void recff_sbufx_set_ptr(jit_State *J, TRef ud, IRFieldID fl, TRef val)
 {
   TRef fref = emitir(IRT(IR_FREF, IRT_PTR), ud, fl);
   emitir(IRT(IR_FSTORE, IRT_PTR), fref, val);
 }
 
-static LJ_AINLINE TRef recff_sbufx_len(jit_State *J, TRef trr, TRef trw)
-{
-  TRef len = emitir(IRT(IR_SUB, IRT_INTP), trw, trr);
-  if (LJ_64)
-    len = emitir(IRTI(IR_CONV), len, (IRT_INT<<5)|IRT_INTP|IRCONV_NONE);
-  return len;
-}
-
-/* Emit typecheck for string buffer. */
-static TRef recff_sbufx_check(jit_State *J, RecordFFData *rd, ptrdiff_t arg)
-{
-  TRef trtype, ud = J->base[arg];
-  if (!tvisbuf(&rd->argv[arg])) lj_trace_err(J, LJ_TRERR_BADTYPE);
-  trtype = emitir(IRT(IR_FLOAD, IRT_U8), ud, IRFL_UDATA_UDTYPE);
-  emitir(IRTGI(IR_EQ), trtype, lj_ir_kint(J, UDTYPE_BUFFER));
-  J->needsnap = 1;
-  return ud;
-}
-
 /* Emit BUFHDR for write to extended string buffer. */
 static TRef recff_sbufx_write(jit_State *J, TRef ud)
 {
@@ -1351,13 +1427,116 @@ static void LJ_FASTCALL recff_buffer_method_ref(jit_State *J, RecordFFData *rd)
 }
 #endif
 
+/* Limits for specialized encoding of fixed-shape tables. */
+#define RECFF_SER_MAXHASH	16	/* Max. number of hash slots. */
+#define RECFF_SER_MAXK		256	/* Max. size of constant chunks. */
+
+/* Check whether a table can be encoded with a specialized sequence.
+** Needs a small hash part with string keys and no array part or metatable.
+** Values must be strings, numbers or booleans.
+*/
+static int recff_serialize_istab(GCtab *t)
+{
+  Node *node = noderef(t->node);
+  uint32_t i;
+  if (t->asize != 0 || tabref(t->metatable) || t->hmask >= RECFF_SER_MAXHASH)
+    return 0;
+  for (i = 0; i <= t->hmask; i++) {
+    cTValue *key = &node[i].key, *val = &node[i].val;
+    if (tvisnil(key))
+      continue;
+    if (!tvisstr(key) || strV(key)->len > RECFF_SER_MAXK-5-1)
+      return 0;
+    if (!(tvisnil(val) || tvisstr(val) || tvisnumber(val) || tvisbool(val)))
+      return 0;
+  }
+  return 1;
+}
+
+/* Flush constant chunk of the encoding. */
+static TRef recff_serialize_flush(jit_State *J, TRef tr, char *kbuf, char *w)
+{
+  if (w != kbuf) {
+    GCstr *str = lj_str_new(J->L, kbuf, (size_t)(w - kbuf));
+    tr = emitir(IRTG(IR_BUFPUT, IRT_PGC), tr, lj_ir_kstr(J, str));
+  }
+  return tr;
+}
+
+/* Emit specialized encoding of a table with a fixed shape. */
+static TRef recff_serialize_tab(jit_State *J, TRef tr, TRef trt, GCtab *t)
+{
+  TRef trv[RECFF_SER_MAXHASH];
+  char kbuf[RECFF_SER_MAXK], *w;
+  Node *node = noderef(t->node);
+  uint32_t i, hmask = t->hmask, nfree = 0;
+  TRef trn;
+  TValue tv;
+  /* Guard the shape: no array part, no metatable, same keys in same slots. */
+  emitir(IRTGI(IR_EQ), emitir(IRTI(IR_FLOAD), trt, IRFL_TAB_ASIZE),
+	 lj_ir_kint(J, 0));
+  emitir(IRTG(IR_EQ, IRT_TAB),
+	 emitir(IRT(IR_FLOAD, IRT_TAB), trt, IRFL_TAB_META),
+	 lj_ir_knull(J, IRT_TAB));
+  emitir(IRTGI(IR_EQ), emitir(IRTI(IR_FLOAD), trt, IRFL_TAB_HMASK),
+	 lj_ir_kint(J, (int32_t)hmask));
+  trn = emitir(IRT(IR_FLOAD, IRT_PGC), trt, IRFL_TAB_NODE);
+  for (i = 0; i <= hmask; i++) {
+    Node *n = &node[i];
+    trv[i] = 0;
+    if (tvisnil(&n->key)) {
+      nfree++;
+    } else {
+      TRef kslot = lj_ir_kslot(J, lj_ir_kstr(J, strV(&n->key)), i);
+      TRef ref = emitir(IRTG(IR_HREFK, IRT_PGC), trn, kslot);
+      trv[i] = emitir(IRTG(IR_HLOAD, itype2irt(&n->val)), ref, 0);
+    }
+  }
+  if (nfree) {  /* HREFK can't check free slots. Check the count instead. */
+    TRef trc = lj_ir_call(J, IRCALL_lj_serialize_nhash, trt);
+    emitir(IRTGI(IR_EQ), trc, lj_ir_kint(J, (int32_t)lj_serialize_nhash(t)));
+  }
+  /* All guards are done. Now emit the writes in encoder order. */
+  settabV(J->L, &tv, t);
+  w = lj_serialize_wconst(kbuf, &tv);
+  for (i = hmask+1; i-- > 0; ) {
+    Node *n = &node[i];
+    if (tvisnil(&n->val))
+      continue;
+    if (w + 5 + strV(&n->key)->len + 1 > kbuf + RECFF_SER_MAXK) {
+      tr = recff_serialize_flush(J, tr, kbuf, w);
+      w = kbuf;
+    }
+    w = lj_serialize_wconst(w, &n->key);
+    if (tvisbool(&n->val)) {
+      w = lj_serialize_wconst(w, &n->val);
+    } else {
+      IRCallID id = tvisstr(&n->val) ? IRCALL_lj_serialize_putstr :
+		    tvisint(&n->val) ? IRCALL_lj_serialize_putint :
+		    IRCALL_lj_serialize_putnum;
+      tr = recff_serialize_flush(J, tr, kbuf, w);
+      w = kbuf;
+      tr = lj_ir_call(J, id, tr, trv[i]);
+    }
+  }
+  return recff_serialize_flush(J, tr, kbuf, w);
+}
+
 static void LJ_FASTCALL recff_buffer_method_encode(jit_State *J, RecordFFData *rd)
 {
   TRef ud = recff_sbufx_check(J, rd, 0);
   TRef trbuf = recff_sbufx_write(J, ud);
-  TRef tmp = recff_tmpref(J, J->base[1], IRTMPREF_IN1);
-  lj_ir_call(J, IRCALL_lj_serialize_put, trbuf, tmp);
-  /* No IR_USE needed, since the call is a store. */
+  if (tref_istab(J->base[1]) && !tabref(bufV(&rd->argv[0])->dict_str) &&
+      recff_serialize_istab(tabV(&rd->argv[1]))) {
+    TRef trd = emitir(IRT(IR_FLOAD, IRT_TAB), ud, IRFL_SBUF_DICT_STR);
+    emitir(IRTG(IR_EQ, IRT_TAB), trd, lj_ir_knull(J, IRT_TAB));
+    trbuf = recff_serialize_tab(J, trbuf, J->base[1], tabV(&rd->argv[1]));
+    emitir(IRT(IR_USE, IRT_NIL), trbuf, 0);
+  } else {
+    TRef tmp = recff_tmpref(J, J->base[1], IRTMPREF_IN1);
+    lj_ir_call(J, IRCALL_lj_serialize_put, trbuf, tmp);
+    /* No IR_USE needed, since the call is a store. */
+  }
 }
 
 static void LJ_FASTCALL recff_buffer_method_decode(jit_State *J, RecordFFData *rd)
@@ -1375,11 +1554,16 @@ static void LJ_FASTCALL recff_buffer_method_decode(jit_State *J, RecordFFData *r
 
 static void LJ_FASTCALL recff_buffer_encode(jit_State *J, RecordFFData *rd)
 {
-  TRef tmp = recff_tmpref(J, J->base[0], IRTMPREF_IN1);
-  J->base[0] = lj_ir_call(J, IRCALL_lj_serialize_encode, tmp);
-  /* IR_USE needed for IR_CALLA, because the encoder may throw non-OOM. */
-  emitir(IRT(IR_USE, IRT_NIL), J->base[0], 0);
-  UNUSED(rd);
+  if (tref_istab(J->base[0]) && recff_serialize_istab(tabV(&rd->argv[0]))) {
+    TRef hdr = recff_bufhdr(J);
+    TRef tr = recff_serialize_tab(J, hdr, J->base[0], tabV(&rd->argv[0]));
+    J->base[0] = emitir(IRTG(IR_BUFSTR, IRT_STR), tr, hdr);
+  } else {
+    TRef tmp = recff_tmpref(J, J->base[0], IRTMPREF_IN1);
+    J->base[0] = lj_ir_call(J, IRCALL_lj_serialize_encode, tmp);
+    /* IR_USE needed for IR_CALLA, because the encoder may throw non-OOM. */
+    emitir(IRT(IR_USE, IRT_NIL), J->base[0], 0);
+  }
 }
 
 static void LJ_FASTCALL recff_buffer_decode(jit_State *J, RecordFFData *rd)
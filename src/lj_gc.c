@@ -28,17 +28,27 @@
 #include "lj_dispatch.h"
 #include "lj_vm.h"
 #include "lj_vmevent.h"
+#if LJ_ASYNCFREE
+#include "lj_alloc.h"
+#endif
 
 #define GCSTEPSIZE	1024u
 #define GCSWEEPMAX	40
 #define GCSWEEPCOST	10
 #define GCFINALIZECOST	100
+#define GCGENMINOR	20	/* Minor cycle after growth by 20% of estimate. */
+#define GCGENMAJOR	100	/* Major cycle after 100% growth since last one. */
 
 /* Macros to set GCobj colors and flags. */
 #define white2gray(x)		((x)->gch.marked &= (uint8_t)~LJ_GC_WHITES)
 #define gray2black(x)		((x)->gch.marked |= LJ_GC_BLACK)
 #define isfinalized(u)		((u)->marked & LJ_GC_FINALIZED)
 
+/* Barriers need to preserve the invariant while marks are kept around. */
+#define gc_keepinvariant(g) \
+  ((g)->gc.state == GCSpropagate || (g)->gc.state == GCSatomic || \
+   (g)->gc.sticky)
+
 /* -- Mark phase ---------------------------------------------------------- */
 
 /* Mark a TValue (if needed). */
@@ -74,6 +84,9 @@ static void gc_mark(global_State *g, GCobj *o)
 	gc_markobj(g, gcref(sbx->dict_str));
       if (gcref(sbx->dict_mt))
 	gc_markobj(g, gcref(sbx->dict_mt));
+      if (gcref(sbx->dict_obj))
+	gc_markobj(g, gcref(sbx->dict_obj));
+      gc_marktv(g, &sbx->jnull);
     }
   } else if (LJ_UNLIKELY(gct == ~LJ_TUPVAL)) {
     GCupval *uv = gco2uv(o);
@@ -101,13 +114,16 @@ static void gc_mark_gcroot(global_State *g)
 /* Start a GC cycle and mark the root set. */
 static void gc_mark_start(global_State *g)
 {
-  setgcrefnull(g->gc.gray);
-  setgcrefnull(g->gc.grayagain);
-  setgcrefnull(g->gc.weak);
+  if (!g->gc.sticky) {  /* Otherwise keep the lists from the last cycle. */
+    setgcrefnull(g->gc.gray);
+    setgcrefnull(g->gc.grayagain);
+    setgcrefnull(g->gc.weak);
+  }
   gc_markobj(g, mainthread(g));
   gc_markobj(g, tabref(mainthread(g)->env));
   gc_marktv(g, &g->registrytv);
   gc_mark_gcroot(g);
+  g->gc.remark = 0;
   g->gc.state = GCSpropagate;
 }
 
@@ -406,14 +422,20 @@ static GCRef *gc_sweep(global_State *g, GCRef *p, uint32_t lim)
 {
   /* Mask with other white and LJ_GC_FIXED. Or LJ_GC_SFIXED on shutdown. */
   int ow = otherwhite(g);
+  int sticky = g->gc.sticky;
   GCobj *o;
   while ((o = gcref(*p)) != NULL && lim-- > 0) {
+    if (o == gcref(g->gc.oldroot)) {  /* Skip old generation in root list. */
+      p = &obj2gco(mainthread(g))->gch.nextgc;  /* But not the userdata. */
+      continue;
+    }
     if (o->gch.gct == ~LJ_TTHREAD)  /* Need to sweep open upvalues, too. */
       gc_fullsweep(g, &gco2th(o)->openupval);
     if (((o->gch.marked ^ LJ_GC_WHITES) & ow)) {  /* Black or current white? */
       lj_assertG(!isdead(g, o) || (o->gch.marked & LJ_GC_FIXED),
 		 "sweep of undead object");
-      makewhite(g, o);  /* Value is alive, change to the current white. */
+      if (!sticky)
+	makewhite(g, o);  /* Value is alive, change to the current white. */
       p = &o->gch.nextgc;
     } else {  /* Otherwise value is dead, free it. */
       lj_assertG(isdead(g, o) || ow == LJ_GC_SFIXED,
@@ -421,12 +443,28 @@ static GCRef *gc_sweep(global_State *g, GCRef *p, uint32_t lim)
       setgcrefr(*p, o->gch.nextgc);
       if (o == gcref(g->gc.root))
 	setgcrefr(g->gc.root, o->gch.nextgc);  /* Adjust list anchor. */
+      if (o == gcref(g->gc.oldnext))
+	setgcrefr(g->gc.oldnext, o->gch.nextgc);  /* Adjust next boundary. */
       gc_freefunc[o->gch.gct - ~LJ_TSTR](g, o);
     }
   }
   return p;
 }
 
+#if LJ_ASYNCFREE
+/* Queue memory freed by sweeping. The allocator's helper thread frees it. */
+#define gc_deferfree(g) \
+  { if ((g)->allocf == lj_alloc_f) (g)->allocf = lj_alloc_fdefer; }
+#define gc_deferdone(g) \
+  { if ((g)->allocf == lj_alloc_fdefer) (g)->allocf = lj_alloc_f; }
+#define gc_deferflush(g) \
+  { if ((g)->allocf == lj_alloc_f) lj_alloc_flushdefer((g)->allocd); }
+#else
+#define gc_deferfree(g)		UNUSED(g)
+#define gc_deferdone(g)		UNUSED(g)
+#define gc_deferflush(g)	UNUSED(g)
+#endif
+
 /* Sweep one string interning table chain. Preserves hashalg bit. */
 static void gc_sweepstr(global_State *g, GCRef *chain)
 {
@@ -441,7 +479,8 @@ static void gc_sweepstr(global_State *g, GCRef *chain)
     if (((o->gch.marked ^ LJ_GC_WHITES) & ow)) {  /* Black or current white? */
       lj_assertG(!isdead(g, o) || (o->gch.marked & LJ_GC_FIXED),
 		 "sweep of undead string");
-      makewhite(g, o);  /* String is alive, change to the current white. */
+      if (!g->gc.sticky)
+	makewhite(g, o);  /* String is alive, change to the current white. */
       p = &o->gch.nextgc;
     } else {  /* Otherwise string is dead, free it. */
       lj_assertG(isdead(g, o) || ow == LJ_GC_SFIXED,
@@ -611,10 +650,45 @@ void lj_gc_freeall(global_State *g)
   MSize i, strmask;
   /* Free everything, except super-fixed objects (the main thread). */
   g->gc.currentwhite = LJ_GC_WHITES | LJ_GC_SFIXED;
+  g->gc.sticky = 0;
+  setgcrefnull(g->gc.oldroot);
+  setgcrefnull(g->gc.oldnext);
   gc_fullsweep(g, &g->gc.root);
   strmask = g->str.mask;
   for (i = 0; i <= strmask; i++)  /* Free all string hash chains. */
     gc_sweepstr(g, &g->str.tab[i]);
+  if (g->str.oldtab) {  /* Including the ones not migrated, yet. */
+    strmask = g->str.oldmask;
+    for (i = 0; i <= strmask; i++)
+      gc_sweepstr(g, &g->str.oldtab[i]);
+  }
+}
+
+/* -- Step timing --------------------------------------------------------- */
+
+#if LJ_TARGET_WINDOWS
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#elif LJ_TARGET_POSIX
+#include <time.h>
+#endif
+
+/* Monotonic clock in microseconds. Only used for relative timing. */
+static uint64_t gc_clock(void)
+{
+#if LJ_TARGET_WINDOWS
+  LARGE_INTEGER t, f;
+  QueryPerformanceCounter(&t);
+  QueryPerformanceFrequency(&f);
+  return (uint64_t)(t.QuadPart / f.QuadPart) * 1000000u +
+	 (uint64_t)(t.QuadPart % f.QuadPart) * 1000000u / (uint64_t)f.QuadPart;
+#elif LJ_TARGET_POSIX && defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000u + (uint64_t)ts.tv_nsec / 1000u;
+#else
+  return (uint64_t)clock() * 1000000u / CLOCKS_PER_SEC;
+#endif
 }
 
 /* -- Collector ----------------------------------------------------------- */
@@ -653,6 +727,30 @@ static void atomic(global_State *g, lua_State *L)
   g->strempty.marked = g->gc.currentwhite;
   setmref(g->gc.sweep, &g->gc.root);
   g->gc.estimate = g->gc.total - (GCSize)udsize;  /* Initial estimate. */
+
+  /* Decide whether the following sweep keeps the marks. */
+  if (!g->gc.genmode) {
+    g->gc.sticky = 0;
+  } else if (!g->gc.sticky) {  /* Full mark: everything alive becomes old. */
+    g->gc.majorbase = g->gc.estimate;
+    g->gc.sticky = 1;
+  } else if (g->gc.estimate >
+	     g->gc.majorbase + (g->gc.majorbase/100) * GCGENMAJOR) {
+    g->gc.sticky = 0;  /* Major cycle: clear all marks, then mark all. */
+  }
+  if (g->gc.sticky)  /* Objects before this one are the young generation. */
+    setgcrefr(g->gc.oldnext, g->gc.root);
+  else
+    setgcrefnull(g->gc.oldroot);
+}
+
+/* Set the threshold for the next GC cycle. */
+static void gc_setpause(global_State *g)
+{
+  if (g->gc.sticky)
+    g->gc.threshold = g->gc.estimate + (g->gc.estimate/100) * GCGENMINOR;
+  else
+    g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
 }
 
 /* GC state machine. Returns a cost estimate for each step performed. */
@@ -666,6 +764,17 @@ static size_t gc_onestep(lua_State *L)
   case GCSpropagate:
     if (gcref(g->gc.gray) != NULL)
       return propagatemark(g);  /* Propagate one gray object. */
+    if (g->gc.pausetarget && !g->gc.remark) {
+      /*
+      ** Propagate the 2nd chance list once before the atomic phase, so
+      ** the atomic phase only needs to revisit the threads and the tables
+      ** that have been modified since then.
+      */
+      setgcrefr(g->gc.gray, g->gc.grayagain);
+      setgcrefnull(g->gc.grayagain);
+      g->gc.remark = 1;
+      return 0;
+    }
     g->gc.state = GCSatomic;  /* End of mark phase. */
     return 0;
   case GCSatomic:
@@ -677,8 +786,15 @@ static size_t gc_onestep(lua_State *L)
     return 0;
   case GCSsweepstring: {
     GCSize old = g->gc.total;
-    gc_sweepstr(g, &g->str.tab[g->gc.sweepstr++]);  /* Sweep one chain. */
-    if (g->gc.sweepstr > g->str.mask)
+    MSize i = g->gc.sweepstr++;
+    gc_deferfree(g);
+    if (i <= g->str.mask)  /* Sweep one chain. */
+      gc_sweepstr(g, &g->str.tab[i]);
+    else  /* Sweep old table during resize, too. */
+      gc_sweepstr(g, &g->str.oldtab[i - g->str.mask - 1]);
+    gc_deferdone(g);
+    if (g->gc.sweepstr > g->str.mask +
+			 (g->str.oldtab ? g->str.oldmask+1 : 0))
       g->gc.state = GCSsweep;  /* All string hash chains sweeped. */
     lj_assertG(old >= g->gc.total, "sweep increased memory");
     g->gc.estimate -= old - g->gc.total;
@@ -686,11 +802,19 @@ static size_t gc_onestep(lua_State *L)
     }
   case GCSsweep: {
     GCSize old = g->gc.total;
+    gc_deferfree(g);
     setmref(g->gc.sweep, gc_sweep(g, mref(g->gc.sweep, GCRef), GCSWEEPMAX));
+    gc_deferdone(g);
+    if (g->str.oldtab)  /* Help with string table resize. */
+      lj_str_migrate(g, GCSWEEPMAX);
     lj_assertG(old >= g->gc.total, "sweep increased memory");
     g->gc.estimate -= old - g->gc.total;
     if (gcref(*mref(g->gc.sweep, GCRef)) == NULL) {
-      if (g->str.num <= (g->str.mask >> 2) && g->str.mask > LJ_MIN_STRTAB*2-1)
+      if (g->gc.sticky)  /* Survivors join the old generation. */
+	setgcrefr(g->gc.oldroot, g->gc.oldnext);
+      gc_deferflush(g);
+      if (g->str.num <= (g->str.mask >> 2) &&
+	  g->str.mask > LJ_MIN_STRTAB*2-1 && !g->str.oldtab)
 	lj_str_resize(L, g->str.mask >> 1);  /* Shrink string table. */
       if (gcref(g->gc.mmudata)) {  /* Need any finalizations? */
 	g->gc.state = GCSfinalize;
@@ -733,6 +857,8 @@ int LJ_FASTCALL lj_gc_step(lua_State *L)
 {
   global_State *g = G(L);
   GCSize lim;
+  uint64_t deadline = 0;
+  size_t work = 0;
   int32_t ostate = g->vmstate;
   setvmstate(g, GC);
   lim = (GCSTEPSIZE/100) * g->gc.stepmul;
@@ -740,13 +866,28 @@ int LJ_FASTCALL lj_gc_step(lua_State *L)
     lim = LJ_MAX_MEM;
   if (g->gc.total > g->gc.threshold)
     g->gc.debt += g->gc.total - g->gc.threshold;
+  if (g->gc.pausetarget)
+    deadline = gc_clock() + g->gc.pausetarget;
   do {
-    lim -= (GCSize)gc_onestep(L);
+    int ostep = g->gc.state;
+    size_t cost = gc_onestep(L);
+    lim -= (GCSize)cost;
     if (g->gc.state == GCSpause) {
-      g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
+      gc_setpause(g);
       g->vmstate = ostate;
       return 1;  /* Finished a GC cycle. */
     }
+    if (deadline) {  /* Check the time budget every now and then. */
+      work += cost;
+      if (work >= GCSTEPSIZE || g->gc.state != ostep) {
+	work = 0;
+	if (gc_clock() >= deadline) {  /* Out of time: yield to the mutator. */
+	  g->gc.threshold = g->gc.total + GCSTEPSIZE;
+	  g->vmstate = ostate;
+	  return -1;
+	}
+      }
+    }
   } while (sizeof(lim) == 8 ? ((int64_t)lim > 0) : ((int32_t)lim > 0));
   if (g->gc.debt < GCSTEPSIZE) {
     g->gc.threshold = g->gc.total + GCSTEPSIZE;
@@ -787,7 +928,9 @@ void lj_gc_fullgc(lua_State *L)
   global_State *g = G(L);
   int32_t ostate = g->vmstate;
   setvmstate(g, GC);
-  if (g->gc.state <= GCSatomic) {  /* Caught somewhere in the middle. */
+  if (g->gc.state <= GCSatomic || g->gc.sticky) {  /* Caught in the middle. */
+    g->gc.sticky = 0;  /* Clear the marks of the old generation, too. */
+    setgcrefnull(g->gc.oldroot);
     setmref(g->gc.sweep, &g->gc.root);  /* Sweep everything (preserving it). */
     setgcrefnull(g->gc.gray);  /* Reset lists from partial propagation. */
     setgcrefnull(g->gc.grayagain);
@@ -802,7 +945,7 @@ void lj_gc_fullgc(lua_State *L)
   /* Now perform a full GC. */
   g->gc.state = GCSpause;
   do { gc_onestep(L); } while (g->gc.state != GCSpause);
-  g->gc.threshold = (g->gc.estimate/100) * g->gc.pause;
+  gc_setpause(g);
   g->vmstate = ostate;
 }
 
@@ -813,11 +956,11 @@ void lj_gc_barrierf(global_State *g, GCobj *o, GCobj *v)
 {
   lj_assertG(isblack(o) && iswhite(v) && !isdead(g, v) && !isdead(g, o),
 	     "bad object states for forward barrier");
-  lj_assertG(g->gc.state != GCSfinalize && g->gc.state != GCSpause,
-	     "bad GC state");
+  lj_assertG((g->gc.state != GCSfinalize && g->gc.state != GCSpause) ||
+	     g->gc.sticky, "bad GC state");
   lj_assertG(o->gch.gct != ~LJ_TTAB, "barrier object is not a table");
   /* Preserve invariant during propagation. Otherwise it doesn't matter. */
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
+  if (gc_keepinvariant(g))
     gc_mark(g, v);  /* Move frontier forward. */
   else
     makewhite(g, o);  /* Make it white to avoid the following barrier. */
@@ -828,7 +971,7 @@ void LJ_FASTCALL lj_gc_barrieruv(global_State *g, TValue *tv)
 {
 #define TV2MARKED(x) \
   (*((uint8_t *)(x) - offsetof(GCupval, tv) + offsetof(GCupval, marked)))
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
+  if (gc_keepinvariant(g))
     gc_mark(g, gcV(tv));
   else
     TV2MARKED(tv) = (TV2MARKED(tv) & (uint8_t)~LJ_GC_COLORS) | curwhite(g);
@@ -846,7 +989,7 @@ void lj_gc_closeuv(global_State *g, GCupval *uv)
   setgcrefr(o->gch.nextgc, g->gc.root);
   setgcref(g->gc.root, o);
   if (isgray(o)) {  /* A closed upvalue is never gray, so fix this. */
-    if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic) {
+    if (gc_keepinvariant(g)) {
       gray2black(o);  /* Make it black and preserve invariant. */
       if (tviswhite(&uv->tv))
 	lj_gc_barrierf(g, o, gcV(&uv->tv));
@@ -862,7 +1005,7 @@ void lj_gc_closeuv(global_State *g, GCupval *uv)
 /* Mark a trace if it's saved during the propagation phase. */
 void lj_gc_barriertrace(global_State *g, uint32_t traceno)
 {
-  if (g->gc.state == GCSpropagate || g->gc.state == GCSatomic)
+  if (gc_keepinvariant(g))
     gc_marktrace(g, traceno);
 }
 #endif
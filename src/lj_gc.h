@@ -83,8 +83,8 @@ static LJ_AINLINE void lj_gc_barrierback(global_State *g, GCtab *t)
   GCobj *o = obj2gco(t);
   lj_assertG(isblack(o) && !isdead(g, o),
 	     "bad object states for backward barrier");
-  lj_assertG(g->gc.state != GCSfinalize && g->gc.state != GCSpause,
-	     "bad GC state");
+  lj_assertG((g->gc.state != GCSfinalize && g->gc.state != GCSpause) ||
+	     g->gc.sticky, "bad GC state");
   black2gray(o);
   setgcrefr(t->gclist, g->gc.grayagain);
   setgcref(g->gc.grayagain, o);
@@ -211,6 +211,7 @@ IRFPMDEF(FPMENUM)
   _(SBUF_L,	sizeof(GCudata) + offsetof(SBufExt, L)) \
   _(SBUF_REF,	sizeof(GCudata) + offsetof(SBufExt, cowref)) \
   _(SBUF_R,	sizeof(GCudata) + offsetof(SBufExt, r)) \
+  _(SBUF_DICT_STR, sizeof(GCudata) + offsetof(SBufExt, dict_str)) \
   _(CDATA_CTYPEID, offsetof(GCcdata, ctypeid)) \
   _(CDATA_PTR,	sizeof(GCcdata)) \
   _(CDATA_INT,	sizeof(GCcdata)) \
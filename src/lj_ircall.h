@@ -153,6 +153,7 @@ typedef struct CCallInfo {
 #define IRCALLDEF(_) \
   _(ANY,	lj_str_cmp,		2,  FN, INT, CCI_NOFPRCLOBBER) \
   _(ANY,	lj_str_find,		4,   N, PGC, 0) \
+  _(ANY,	lj_str_utf8len,		1,  FN, INT, 0) \
   _(ANY,	lj_str_new,		3,   S, STR, CCI_L|CCI_T) \
   _(ANY,	lj_strscan_num,		2,  FN, INT, 0) \
   _(ANY,	lj_strfmt_int,		2,  FN, STR, CCI_L|CCI_T) \
@@ -161,6 +162,7 @@ typedef struct CCallInfo {
   _(ANY,	lj_strfmt_putint,	2,  FL, PGC, CCI_T) \
   _(ANY,	lj_strfmt_putnum,	2,  FL, PGC, CCI_T) \
   _(ANY,	lj_strfmt_putquoted,	2,  FL, PGC, CCI_T) \
+  _(ANY,	lj_strfmt_putptr,	2,  FL, PGC, CCI_T) \
   _(ANY,	lj_strfmt_putfxint,	3,   L, PGC, XA_64|CCI_T) \
   _(ANY,	lj_strfmt_putfnum_int,	3,   L, PGC, XA_FP|CCI_T) \
   _(ANY,	lj_strfmt_putfnum_uint,	3,   L, PGC, XA_FP|CCI_T) \
@@ -170,6 +172,7 @@ typedef struct CCallInfo {
   _(ANY,	lj_buf_putmem,		3,   S, PGC, CCI_T) \
   _(ANY,	lj_buf_putstr,		2,  FL, PGC, CCI_T) \
   _(ANY,	lj_buf_putchar,		2,  FL, PGC, CCI_T) \
+  _(ANY,	lj_buf_pututf8,		2,  FL, PGC, CCI_T) \
   _(ANY,	lj_buf_putstr_reverse,	2,  FL, PGC, CCI_T) \
   _(ANY,	lj_buf_putstr_lower,	2,  FL, PGC, CCI_T) \
   _(ANY,	lj_buf_putstr_upper,	2,  FL, PGC, CCI_T) \
@@ -181,6 +184,9 @@ typedef struct CCallInfo {
   _(BUFFER,	lj_serialize_get,	2,  FS, PTR, CCI_T) \
   _(BUFFER,	lj_serialize_encode,	2,  FA, STR, CCI_L|CCI_T) \
   _(BUFFER,	lj_serialize_decode,	3,   A, INT, CCI_L|CCI_T) \
+  _(BUFFER,	lj_serialize_putstr,	2,  FL, PGC, CCI_T) \
+  _(BUFFER,	lj_serialize_putint,	2,  FL, PGC, CCI_T) \
+  _(BUFFER,	lj_serialize_putnum,	2,   L, PGC, XA_FP|CCI_T) \
   _(ANY,	lj_buf_tostr,		1,  FL, STR, CCI_T) \
   _(ANY,	lj_tab_new_ah,		3,   A, TAB, CCI_L|CCI_T) \
   _(ANY,	lj_tab_new1,		2,  FA, TAB, CCI_L|CCI_T) \
@@ -191,6 +197,7 @@ typedef struct CCallInfo {
   _(ANY,	lj_vm_next,		2,  FL, PTR, 0) \
   _(ANY,	lj_tab_len,		1,  FL, INT, 0) \
   _(ANY,	lj_tab_len_hint,	2,  FL, INT, 0) \
+  _(BUFFER,	lj_serialize_nhash,	1,  FL, INT, 0) \
   _(ANY,	lj_gc_step_jit,		2,  FS, NIL, CCI_L) \
   _(ANY,	lj_gc_barrieruv,	2,  FS, NIL, 0) \
   _(ANY,	lj_mem_newgco,		2,  FA, PGC, CCI_L|CCI_T) \
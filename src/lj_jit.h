@@ -113,13 +113,20 @@
 
 /* -- JIT engine parameters ----------------------------------------------- */
 
-#if LJ_TARGET_WINDOWS || LJ_64
+#if LJ_HUGEPAGES
+/* One huge page per area. */
+#define JIT_P_sizemcode_DEFAULT		(LJ_HUGEPAGESIZE >> 10)
+#define JIT_P_maxmcode_DEFAULT		(4*JIT_P_sizemcode_DEFAULT)
+#elif LJ_TARGET_WINDOWS || LJ_64
 /* See: https://devblogs.microsoft.com/oldnewthing/20031008-00/?p=42223 */
 #define JIT_P_sizemcode_DEFAULT		64
 #else
 /* Could go as low as 4K, but the mmap() overhead would be rather high. */
 #define JIT_P_sizemcode_DEFAULT		32
 #endif
+#ifndef JIT_P_maxmcode_DEFAULT
+#define JIT_P_maxmcode_DEFAULT		512
+#endif
 
 /* Optimization parameters and their defaults. Length is a char in octal! */
 #define JIT_PARAMDEF(_) \
@@ -142,7 +149,7 @@
   /* Size of each machine code area (in KBytes). */ \
   _(\011, sizemcode,	JIT_P_sizemcode_DEFAULT) \
   /* Max. total size of all machine code areas (in KBytes). */ \
-  _(\010, maxmcode,	512) \
+  _(\010, maxmcode,	JIT_P_maxmcode_DEFAULT) \
   /* End of list. */
 
 enum {
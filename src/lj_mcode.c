@@ -124,9 +124,40 @@ static int mcode_setprot(void *p, size_t sz, DWORD prot)
 #define MCPROT_CREATE	0
 #endif
 
+#if LJ_HUGEPAGES
+/* Map areas of at least one huge page aligned and with huge page backing. */
+static void *mcode_mmap(uintptr_t hint, size_t sz, int prot)
+{
+  char *p, *q;
+  if (sz < LJ_HUGEPAGESIZE || (hint & (LJ_HUGEPAGESIZE-1)))
+    return mmap((void *)hint, sz, prot, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (hint) {
+    p = (char *)mmap((void *)hint, sz, prot, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    q = p;
+  } else {  /* Map a larger area and trim it to alignment. */
+    p = (char *)mmap(NULL, sz + LJ_HUGEPAGESIZE, prot,
+		     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (p == (char *)MAP_FAILED)
+      return mmap(NULL, sz, prot, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    q = (char *)(((uintptr_t)p + LJ_HUGEPAGESIZE-1) &
+		 ~(uintptr_t)(LJ_HUGEPAGESIZE-1));
+    if (q != p) munmap(p, (size_t)(q - p));
+    munmap(q + sz, LJ_HUGEPAGESIZE - (size_t)(q - p));
+  }
+#ifdef MADV_HUGEPAGE
+  if (p != (char *)MAP_FAILED && !((uintptr_t)q & (LJ_HUGEPAGESIZE-1)))
+    madvise(q, sz, MADV_HUGEPAGE);  /* Ignore result. It's only a hint. */
+#endif
+  return p == (char *)MAP_FAILED ? MAP_FAILED : (void *)q;
+}
+#else
+#define mcode_mmap(hint, sz, prot) \
+  mmap((void *)(hint), (sz), (prot), MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)
+#endif
+
 static void *mcode_alloc_at(jit_State *J, uintptr_t hint, size_t sz, int prot)
 {
-  void *p = mmap((void *)hint, sz, prot|MCPROT_CREATE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  void *p = mcode_mmap(hint, sz, prot|MCPROT_CREATE);
   if (p == MAP_FAILED) {
     if (!hint) lj_trace_err(J, LJ_TRERR_MCODEAL);
     p = NULL;
@@ -255,6 +286,10 @@ static void *mcode_alloc(jit_State *J, size_t sz)
       hint = lj_prng_u64(&J2G(J)->prng) & ((1u<<LJ_TARGET_JUMPRANGE)-0x10000);
     } while (!(hint + sz < range+range));
     hint = target + hint - range;
+#if LJ_HUGEPAGES
+    if (sz >= LJ_HUGEPAGESIZE)  /* Keep areas huge page aligned. */
+      hint &= ~(uintptr_t)(LJ_HUGEPAGESIZE-1);
+#endif
   }
   lj_trace_err(J, LJ_TRERR_MCODEAL);  /* Give up. OS probably ignores hints? */
   return NULL;
@@ -336,6 +336,7 @@ enum {
   UDTYPE_IO_FILE,	/* I/O library FILE. */
   UDTYPE_FFI_CLIB,	/* FFI C library namespace. */
   UDTYPE_BUFFER,	/* String buffer. */
+  UDTYPE_MMAP,		/* Memory-mapped file for string buffers. */
   UDTYPE__MAX
 };
 
@@ -579,6 +580,8 @@ typedef enum {
   GCROOT_BASEMT_NUM = GCROOT_BASEMT + ~LJ_TNUMX,
   GCROOT_IO_INPUT,	/* Userdata for default I/O input file. */
   GCROOT_IO_OUTPUT,	/* Userdata for default I/O output file. */
+  GCROOT_STR_PATCACHE,	/* Weak table of compiled string patterns. */
+  GCROOT_STR_FMTCACHE,	/* Weak table of compiled format strings. */
   GCROOT_MAX
 } GCRootID;
 
@@ -609,6 +612,13 @@ typedef struct GCState {
   GCSize estimate;	/* Estimate of memory actually in use. */
   MSize stepmul;	/* Incremental GC step granularity. */
   MSize pause;		/* Pause between successive GC cycles. */
+  MSize pausetarget;	/* Time budget per GC step in microseconds or 0. */
+  uint8_t remark;	/* 2nd chance list has been propagated early. */
+  uint8_t genmode;	/* Generational mode enabled. */
+  uint8_t sticky;	/* Survivors keep their marks (minor cycle). */
+  GCSize majorbase;	/* Estimate after the last full mark. */
+  GCRef oldroot;	/* First object of the old generation in root list. */
+  GCRef oldnext;	/* Next oldroot, once the current sweep is done. */
 #if LJ_64
   MRef lightudseg;	/* Upper bits of lightuserdata segments. */
 #endif
@@ -619,11 +629,14 @@ typedef struct StrInternState {
   GCRef *tab;		/* String hash table anchors. */
   MSize mask;		/* String hash mask (size of hash table - 1). */
   MSize num;		/* Number of strings in hash table. */
+  GCRef *oldtab;	/* Old hash table anchors during resize or NULL. */
+  MSize oldmask;	/* Old hash mask. */
+  MSize migrate;	/* Next old chain to migrate. */
   StrID id;		/* Next string ID. */
   uint8_t idreseed;	/* String ID reseed counter. */
-  uint8_t second;	/* String interning table uses secondary hashing. */
   uint8_t unused1;
   uint8_t unused2;
+  uint8_t unused3;
   LJ_ALIGN(8) uint64_t seed;	/* Random string seed. */
 } StrInternState;
 
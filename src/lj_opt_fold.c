@@ -558,6 +558,12 @@ LJFOLDF(kfold_strcmp)
   return NEXTFOLD;
 }
 
+LJFOLD(CALLN KGC IRCALL_lj_str_utf8len)
+LJFOLDF(kfold_utf8len)
+{
+  return INTFOLD(lj_str_utf8len(ir_kstr(fleft)));
+}
+
 /* -- Constant folding and forwarding for buffers ------------------------- */
 
 /*
@@ -721,6 +727,20 @@ LJFOLDF(bufput_kfold_rep)
   return EMITFOLD;  /* Always emit, CSE later. */
 }
 
+LJFOLD(CALLL CARG IRCALL_lj_buf_pututf8)
+LJFOLDF(bufput_kfold_utf8)
+{
+  if (irref_isk(fleft->op2)) {
+    SBuf *sb = lj_buf_tmp_(J->L);
+    sb = lj_buf_pututf8(sb, (uint32_t)IR(fleft->op2)->i);
+    fins->o = IR_BUFPUT;
+    fins->op1 = fleft->op1;
+    fins->op2 = lj_ir_kstr(J, lj_buf_tostr(sb));
+    return RETRYFOLD;
+  }
+  return EMITFOLD;  /* Always emit, CSE later. */
+}
+
 LJFOLD(CALLL CARG IRCALL_lj_strfmt_putfxint)
 LJFOLD(CALLL CARG IRCALL_lj_strfmt_putfnum_int)
 LJFOLD(CALLL CARG IRCALL_lj_strfmt_putfnum_uint)
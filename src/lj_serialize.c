@@ -13,7 +13,15 @@
 #include "lj_buf.h"
 #include "lj_str.h"
 #include "lj_tab.h"
+#include "lj_func.h"
 #include "lj_udata.h"
+#include "lj_frame.h"
+#include "lj_vm.h"
+#include "lj_lex.h"
+#include "lj_bcdump.h"
+#include "lj_char.h"
+#include "lj_strscan.h"
+#include "lj_strfmt.h"
 #if LJ_HASFFI
 #include "lj_ctype.h"
 #include "lj_cdata.h"
@@ -39,23 +47,25 @@ enum {
   SER_TAG_INT64,	/* 0x10 */
   SER_TAG_UINT64,
   SER_TAG_COMPLEX,
-  SER_TAG_0x13,
-  SER_TAG_0x14,
-  SER_TAG_0x15,
-  SER_TAG_0x16,
-  SER_TAG_0x17,
-  SER_TAG_0x18,		/* 0x18 */
-  SER_TAG_0x19,
-  SER_TAG_0x1a,
-  SER_TAG_0x1b,
-  SER_TAG_0x1c,
-  SER_TAG_0x1d,
+  SER_TAG_REF,		/* Snapshot only. */
+  SER_TAG_FUNC,
+  SER_TAG_PROTO,
+  SER_TAG_UPVAL,
+  SER_TAG_MT,
+  SER_TAG_PACK_U8,	/* 0x18: Packed array elements. */
+  SER_TAG_PACK_INT,
+  SER_TAG_PACK_NUM,
+  SER_TAG_PACK_INT64,
+  SER_TAG_PACK_UINT64,
+  SER_TAG_SNAP,		/* Snapshot header. */
   SER_TAG_0x1e,
   SER_TAG_0x1f,
   SER_TAG_STR,		/* 0x20 + str->len */
 };
 LJ_STATIC_ASSERT((SER_TAG_TAB & 7) == 0);
 
+#define SER_PACK_MIN	4	/* Min. number of array elements to pack. */
+
 /* -- Helper functions ---------------------------------------------------- */
 
 static LJ_AINLINE char *serialize_more(char *w, SBufExt *sbx, MSize sz)
@@ -163,8 +173,236 @@ void LJ_FASTCALL lj_serialize_dict_prep_mt(lua_State *L, GCtab *dict)
   }
 }
 
+/* Check object dictionary for snapshots. */
+void LJ_FASTCALL lj_serialize_dict_check_obj(lua_State *L, GCtab *dict)
+{
+  MSize i, len = lj_tab_len(dict);
+  for (i = 1; i <= len; i++) {
+    cTValue *o = lj_tab_getint(dict, (int32_t)i);
+    if (!(tvistab(o) || tvisfunc(o) || tvisudata(o) || tvisthread(o) ||
+	  tvisfalse(o)))
+      lj_err_caller(L, LJ_ERR_BUFFER_BADOPT);
+  }
+}
+
+/* -- Snapshot references ------------------------------------------------- */
+
+/* Create the reference table for a snapshot or restore and anchor it.
+** The object dictionary occupies the first reference indexes.
+*/
+static void serialize_refs_new(lua_State *L, SBufExt *sbx, int enc)
+{
+  GCtab *dict = tabref(sbx->dict_obj);
+  MSize i, len = dict ? lj_tab_len(dict) : 0;
+  GCtab *refs = enc ? lj_tab_new(L, 0, hsize2hbits(len)) :
+		      lj_tab_new(L, len, 0);
+  settabV(L, L->top++, refs);
+  setgcref(sbx->refs, obj2gco(refs));
+  for (i = 1; i <= len; i++) {
+    cTValue *o = lj_tab_getint(dict, (int32_t)i);
+    if (tvistab(o) || tvisfunc(o) || tvisudata(o) || tvisthread(o)) {
+      if (enc) {
+	TValue *v = lj_tab_set(L, refs, o);
+	if (tvisnil(v)) v->u64 = (uint64_t)(i-1);  /* Ignore dups. */
+      } else {
+	copyTV(L, lj_tab_setint(L, refs, (int32_t)(i-1)), o);
+      }
+    }
+  }
+  sbx->nref = len;
+}
+
+/* Lookup reference index of an object or assign a new one. */
+static int serialize_ref(SBufExt *sbx, GCobj *o, uint32_t *pidx)
+{
+  lua_State *L = sbufL(sbx);
+  TValue k, *v;
+  setgcV(L, &k, o, ~(uint32_t)o->gch.gct);
+  v = lj_tab_set(L, tabref(sbx->refs), &k);
+  if (tvisnil(v)) {
+    v->u64 = (uint64_t)sbx->nref++;
+    return 0;
+  }
+  *pidx = v->u32.lo;
+  return 1;
+}
+
+/* Set decoded object for reference index. */
+static void serialize_setref(SBufExt *sbx, uint32_t idx, GCobj *o)
+{
+  lua_State *L = sbufL(sbx);
+  TValue *v = lj_tab_setint(L, tabref(sbx->refs), (int32_t)idx);
+  setgcV(L, v, o, ~(uint32_t)o->gch.gct);
+}
+
+/* Get decoded object for reference index. */
+static cTValue *serialize_getref(SBufExt *sbx, uint32_t idx)
+{
+  cTValue *v = lj_tab_getint(tabref(sbx->refs), (int32_t)idx);
+  if (!v || tvisnil(v))
+    lj_err_callerv(sbufL(sbx), LJ_ERR_BUFFER_BADREF, idx);
+  return v;
+}
+
 /* -- Internal serializer ------------------------------------------------- */
 
+static char *serialize_put(char *w, SBufExt *sbx, cTValue *o);
+
+/* Write reference to an already serialized object. */
+static char *serialize_putref(char *w, SBufExt *sbx, uint32_t idx)
+{
+  w = serialize_more(w, sbx, 1+5);
+  *w++ = SER_TAG_REF;
+  return serialize_wu124(w, idx);
+}
+
+/* Bytecode writer callback. */
+static int serialize_writer(lua_State *L, const void *p, size_t sz, void *sb)
+{
+  UNUSED(L);
+  lj_buf_putmem((SBuf *)sb, p, (MSize)sz);
+  return 0;
+}
+
+/* Put prototype as a bytecode dump. */
+static char *serialize_putproto(char *w, SBufExt *sbx, GCproto *pt)
+{
+  uint32_t idx;
+  if (serialize_ref(sbx, obj2gco(pt), &idx)) {
+    w = serialize_putref(w, sbx, idx);
+  } else {
+    lua_State *L = sbufL(sbx);
+    SBuf *sb = lj_buf_tmp_(L);
+    int status = lj_bcwrite(L, pt, serialize_writer, sb, LJ_FR2*BCDUMP_F_FR2);
+    MSize len = sbuflen(sb);
+    if (status) lj_err_throw(L, status);
+    w = serialize_more(w, sbx, 1+5+len);
+    *w++ = SER_TAG_PROTO;
+    w = serialize_wu124(w, len);
+    w = lj_buf_wmem(w, sb->b, len);
+  }
+  return w;
+}
+
+/* Put function, userdata or thread for a snapshot. */
+static char *serialize_putobj(char *w, SBufExt *sbx, cTValue *o)
+{
+  lua_State *L = sbufL(sbx);
+  uint32_t idx;
+  if (serialize_ref(sbx, gcV(o), &idx)) {
+    w = serialize_putref(w, sbx, idx);
+  } else if (tvisfunc(o) && isluafunc(funcV(o))) {
+    GCfunc *fn = funcV(o);
+    GCtab *env = tabref(fn->l.env);
+    uint32_t i, nuv = fn->l.nupvalues;
+    if (sbx->depth <= 0) lj_err_caller(L, LJ_ERR_BUFFER_DEPTH);
+    sbx->depth--;
+    w = serialize_more(w, sbx, 1);
+    *w++ = SER_TAG_FUNC;
+    w = serialize_putproto(w, sbx, funcproto(fn));
+    if (env == tabref(L->env)) {  /* Globals of the current thread. */
+      w = serialize_more(w, sbx, 1+5);
+      *w++ = SER_TAG_NIL;
+    } else {
+      TValue tv;
+      settabV(L, &tv, env);
+      w = serialize_put(w, sbx, &tv);
+      w = serialize_more(w, sbx, 5);
+    }
+    w = serialize_wu124(w, nuv);
+    for (i = 0; i < nuv; i++) {
+      GCupval *uv = &gcref(fn->l.uvptr[i])->uv;
+      if (serialize_ref(sbx, obj2gco(uv), &idx)) {
+	w = serialize_putref(w, sbx, idx);
+      } else {
+	w = serialize_more(w, sbx, 1);
+	*w++ = SER_TAG_UPVAL;
+	w = serialize_put(w, sbx, uvval(uv));
+      }
+    }
+    sbx->depth++;
+  } else {
+    lj_err_callerv(L, LJ_ERR_BUFFER_BADENC, lj_typename(o));
+  }
+  return w;
+}
+
+/* Get tag for packed encoding of uniform array elements or 0. */
+static uint32_t serialize_packtag(cTValue *oa, cTValue *oe)
+{
+  uint32_t tp = SER_TAG_PACK_U8;
+  if (oe - oa < SER_PACK_MIN) return 0;
+  if (tvisnumber(oa)) {
+    for (; oa < oe; oa++) {
+      if (tvisint(oa)) {
+	if ((uint32_t)intV(oa) > 255) tp = SER_TAG_PACK_INT;
+      } else if (tvisnum(oa)) {
+	lua_Number n = numV(oa);
+	int32_t k = lj_num2int(n);
+	if (tp == SER_TAG_PACK_NUM) continue;
+	if (n != (lua_Number)k || oa->u64 == U64x(80000000,00000000))
+	  tp = SER_TAG_PACK_NUM;  /* Not an int32 or -0. */
+	else if ((uint32_t)k > 255)
+	  tp = SER_TAG_PACK_INT;
+      } else {
+	return 0;
+      }
+    }
+    return tp;
+#if LJ_HASFFI
+  } else if (tviscdata(oa)) {
+    CTypeID id = cdataV(oa)->ctypeid;
+    if (id != CTID_INT64 && id != CTID_UINT64) return 0;
+    for (oa++; oa < oe; oa++)
+      if (!tviscdata(oa) || cdataV(oa)->ctypeid != id) return 0;
+    return id == CTID_INT64 ? SER_TAG_PACK_INT64 : SER_TAG_PACK_UINT64;
+#endif
+  }
+  return 0;
+}
+
+/* Write packed array elements. */
+static char *serialize_putpack(char *w, SBufExt *sbx, uint32_t tp,
+			       cTValue *oa, cTValue *oe)
+{
+  MSize n = (MSize)(oe - oa);
+  MSize sz = tp == SER_TAG_PACK_U8 ? 1 : tp == SER_TAG_PACK_INT ? 4 : 8;
+  w = serialize_more(w, sbx, 1+5+n*sz);
+  *w++ = (char)tp;
+  w = serialize_wu124(w, n);
+  if (tp == SER_TAG_PACK_U8) {
+    for (; oa < oe; oa++)
+      *w++ = (char)(tvisint(oa) ? intV(oa) : lj_num2int(numV(oa)));
+  } else if (tp == SER_TAG_PACK_INT) {
+    for (; oa < oe; oa++, w += 4) {
+      uint32_t x = (uint32_t)(tvisint(oa) ? intV(oa) : lj_num2int(numV(oa)));
+      if (LJ_BE) x = lj_bswap(x);
+      memcpy(w, &x, 4);
+    }
+  } else if (tp == SER_TAG_PACK_NUM) {
+#if LJ_LE && !LJ_DUALNUM
+    memcpy(w, oa, n*8);  /* Numbers are stored unboxed. */
+    w += n*8;
+#else
+    for (; oa < oe; oa++, w += 8) {
+      TValue tv;
+      setnumV(&tv, numberVnum(oa));
+      if (LJ_BE) tv.u64 = lj_bswap64(tv.u64);
+      memcpy(w, &tv, 8);
+    }
+#endif
+#if LJ_HASFFI
+  } else {
+    for (; oa < oe; oa++, w += 8) {
+      uint64_t x = *(uint64_t *)cdataptr(cdataV(oa));
+      if (LJ_BE) x = lj_bswap64(x);
+      memcpy(w, &x, 8);
+    }
+#endif
+  }
+  return w;
+}
+
 /* Put serialized object into buffer. */
 static char *serialize_put(char *w, SBufExt *sbx, cTValue *o)
 {
@@ -188,6 +426,22 @@ static char *serialize_put(char *w, SBufExt *sbx, cTValue *o)
   } else if (tvistab(o)) {
     const GCtab *t = tabV(o);
     uint32_t narray = 0, nhash = 0, one = 2;
+    int snapmt = 0;
+    if (LJ_UNLIKELY(tabref(sbx->refs))) {  /* Snapshot of shared table. */
+      uint32_t idx;
+      if (serialize_ref(sbx, obj2gco(t), &idx))
+	return serialize_putref(w, sbx, idx);
+      if (tabref(t->metatable)) {
+	GCtab *dict_mt = tabref(sbx->dict_mt);
+	TValue mto;
+	settabV(sbufL(sbx), &mto, tabref(t->metatable));
+	if (!dict_mt || tvisnil(lj_tab_get(sbufL(sbx), dict_mt, &mto))) {
+	  w = serialize_more(w, sbx, 1);
+	  *w++ = SER_TAG_MT;  /* Metatable follows after the table. */
+	  snapmt = 1;
+	}
+      }
+    }
     if (sbx->depth <= 0) lj_err_caller(sbufL(sbx), LJ_ERR_BUFFER_DEPTH);
     sbx->depth--;
     if (t->asize > 0) {  /* Determine max. length of array part. */
@@ -229,7 +483,11 @@ static char *serialize_put(char *w, SBufExt *sbx, cTValue *o)
     if (narray) {  /* Write array entries. */
       cTValue *oa = tvref(t->array) + (one >> 2);
       cTValue *oe = tvref(t->array) + narray;
-      while (oa < oe) w = serialize_put(w, sbx, oa++);
+      uint32_t tp = serialize_packtag(oa, oe);
+      if (tp)
+	w = serialize_putpack(w, sbx, tp, oa, oe);
+      else
+	while (oa < oe) w = serialize_put(w, sbx, oa++);
     }
     if (nhash) {  /* Write hash entries. */
       const Node *node = noderef(t->node) + t->hmask;
@@ -273,6 +531,11 @@ static char *serialize_put(char *w, SBufExt *sbx, cTValue *o)
 	  }
       }
     }
+    if (snapmt) {
+      TValue mto;
+      settabV(sbufL(sbx), &mto, tabref(t->metatable));
+      w = serialize_put(w, sbx, &mto);
+    }
     sbx->depth++;
 #if LJ_HASFFI
   } else if (tviscdata(o)) {
@@ -324,6 +587,8 @@ static char *serialize_put(char *w, SBufExt *sbx, cTValue *o)
       *w++ = SER_TAG_LIGHTUD64; memcpy(w, &ud, 8); w += 8;
 #endif
     }
+  } else if (LJ_UNLIKELY(tabref(sbx->refs))) {
+    w = serialize_putobj(w, sbx, o);
   } else {
     /* NYI userdata */
 #if LJ_HASFFI
@@ -334,6 +599,234 @@ static char *serialize_put(char *w, SBufExt *sbx, cTValue *o)
   return w;
 }
 
+/* Reader context for embedded bytecode dumps. */
+typedef struct SerializeReadCtx {
+  const char *p;
+  size_t sz;
+} SerializeReadCtx;
+
+/* Bytecode reader callback. */
+static const char *serialize_reader(lua_State *L, void *ud, size_t *size)
+{
+  SerializeReadCtx *ctx = (SerializeReadCtx *)ud;
+  UNUSED(L);
+  if (ctx->sz == 0) return NULL;
+  *size = ctx->sz;
+  ctx->sz = 0;
+  return ctx->p;
+}
+
+/* Protected callback for bytecode reader. */
+static TValue *cpserialize_proto(lua_State *L, lua_CFunction dummy, void *ud)
+{
+  LexState *ls = (LexState *)ud;
+  UNUSED(dummy);
+  cframe_errfunc(L->cframe) = -1;  /* Inherit error function. */
+  lj_lex_setup(L, ls);  /* Dump signature has already been checked. */
+  setprotoV(L, L->top++, lj_bcread(ls));
+  return NULL;
+}
+
+/* Get prototype from bytecode dump. */
+static char *serialize_getproto(char *r, SBufExt *sbx, GCproto **ppt)
+{
+  lua_State *L = sbufL(sbx);
+  char *w = sbx->w;
+  uint32_t tp, v;
+  r = serialize_ru124(r, w, &tp); if (LJ_UNLIKELY(!r)) goto eob;
+  r = serialize_ru124(r, w, &v); if (LJ_UNLIKELY(!r)) goto eob;
+  if (tp == SER_TAG_REF) {
+    cTValue *o = serialize_getref(sbx, v);
+    if (!tvisproto(o)) lj_err_callerv(L, LJ_ERR_BUFFER_BADREF, v);
+    *ppt = protoV(o);
+  } else if (tp == SER_TAG_PROTO) {
+    LexState ls;
+    SerializeReadCtx ctx;
+    int status;
+    if (LJ_UNLIKELY(v > (uint32_t)(w - r))) goto eob;
+    if (v == 0 || (uint8_t)*r != BCDUMP_HEAD1)
+      lj_err_callerv(L, LJ_ERR_BUFFER_BADDEC, tp);
+    ctx.p = r;
+    ctx.sz = v;
+    ls.rfunc = serialize_reader;
+    ls.rdata = &ctx;
+    ls.chunkarg = "?";
+    ls.mode = NULL;
+    lj_buf_init(L, &ls.sb);
+    status = lj_vm_cpcall(L, NULL, &ls, cpserialize_proto);
+    lj_lex_cleanup(L, &ls);
+    if (status) lj_err_throw(L, status);
+    *ppt = protoV(L->top-1);
+    L->top--;
+    serialize_setref(sbx, sbx->nref++, obj2gco(*ppt));
+    r += v;
+  } else {
+    lj_err_callerv(L, LJ_ERR_BUFFER_BADDEC, tp);
+  }
+  return r;
+eob:
+  lj_err_caller(L, LJ_ERR_BUFFER_EOB);
+  return NULL;
+}
+
+static char *serialize_get(char *r, SBufExt *sbx, TValue *o);
+
+/* Get snapshot reference, function or table with metatable. */
+static char *serialize_getobj(char *r, SBufExt *sbx, uint32_t tp, TValue *o)
+{
+  lua_State *L = sbufL(sbx);
+  char *w = sbx->w;
+  if (tp == SER_TAG_REF) {
+    uint32_t idx;
+    cTValue *v;
+    r = serialize_ru124(r, w, &idx); if (LJ_UNLIKELY(!r)) goto eob;
+    v = serialize_getref(sbx, idx);
+    if (tvisproto(v) || itype(v) == LJ_TUPVAL)
+      lj_err_callerv(L, LJ_ERR_BUFFER_BADREF, idx);
+    copyTV(L, o, v);
+  } else if (tp == SER_TAG_FUNC) {
+    uint32_t i, nuv, idx = sbx->nref++;
+    GCproto *pt;
+    GCfunc *fn;
+    TValue env;
+    if (sbx->depth <= 0) lj_err_caller(L, LJ_ERR_BUFFER_DEPTH);
+    sbx->depth--;
+    r = serialize_getproto(r, sbx, &pt);
+    fn = lj_func_newL_empty(L, pt, tabref(L->env));
+    setfuncV(L, o, fn);
+    serialize_setref(sbx, idx, obj2gco(fn));
+    r = serialize_get(r, sbx, &env);
+    if (tvistab(&env))
+      setgcref(fn->l.env, obj2gco(tabV(&env)));
+    else if (!tvisnil(&env))
+      goto badtag;
+    r = serialize_ru124(r, w, &nuv); if (LJ_UNLIKELY(!r)) goto eob;
+    if (nuv != pt->sizeuv) goto badtag;
+    /* NOBARRIER: The GCfunc and its upvalues are new (marked white). */
+    for (i = 0; i < nuv; i++) {
+      uint32_t utp;
+      r = serialize_ru124(r, w, &utp); if (LJ_UNLIKELY(!r)) goto eob;
+      if (utp == SER_TAG_UPVAL) {
+	GCupval *uv = &gcref(fn->l.uvptr[i])->uv;
+	serialize_setref(sbx, sbx->nref++, obj2gco(uv));
+	r = serialize_get(r, sbx, uvval(uv));
+      } else if (utp == SER_TAG_REF) {
+	cTValue *v;
+	r = serialize_ru124(r, w, &idx); if (LJ_UNLIKELY(!r)) goto eob;
+	v = serialize_getref(sbx, idx);
+	if (itype(v) != LJ_TUPVAL)
+	  lj_err_callerv(L, LJ_ERR_BUFFER_BADREF, idx);
+	setgcref(fn->l.uvptr[i], gcV(v));
+      } else {
+	tp = utp;
+	goto badtag;
+      }
+    }
+    sbx->depth++;
+  } else if (tp == SER_TAG_MT) {
+    TValue mt;
+    if (LJ_UNLIKELY(r >= w)) goto eob;
+    tp = *(uint8_t *)r;
+    if (!(tp >= SER_TAG_TAB && tp < SER_TAG_DICT_MT)) goto badtag;
+    r = serialize_get(r, sbx, o);
+    r = serialize_get(r, sbx, &mt);
+    if (!tvistab(&mt)) goto badtag;
+    /* NOBARRIER: The table is new (marked white). */
+    setgcref(tabV(o)->metatable, obj2gco(tabV(&mt)));
+  } else {
+badtag:
+    lj_err_callerv(L, LJ_ERR_BUFFER_BADDEC, tp);
+  }
+  return r;
+eob:
+  lj_err_caller(L, LJ_ERR_BUFFER_EOB);
+  return NULL;
+}
+
+/* Decode long strings as views into the copy-on-write source object? */
+#define serialize_islazy(sbx, len) \
+  ((sbx)->lazystr && (len) >= (sbx)->lazystr && sbufiscow((sbx)) && \
+   gcref((sbx)->cowref) && !tabref((sbx)->refs))
+
+/* Create read-only buffer view for a string in the source object. */
+static void serialize_getview(SBufExt *sbx, char *r, MSize len, TValue *o)
+{
+  lua_State *L = sbufL(sbx);
+  GCudata *ud0 = (GCudata *)sbx - 1;
+  GCudata *ud = lj_udata_new(L, sizeof(SBufExt), tabref(ud0->env));
+  SBufExt *sbv = (SBufExt *)uddata(ud);
+  ud->udtype = UDTYPE_BUFFER;
+  /* NOBARRIER: The GCudata is new (marked white). */
+  setgcrefr(ud->metatable, ud0->metatable);
+  lj_bufx_init(L, sbv);
+  lj_bufx_set_cow(L, sbv, r, len);
+  setgcrefr(sbv->cowref, sbx->cowref);
+  copyTV(L, &sbv->jnull, &sbx->jnull);
+  setudataV(L, o, ud);
+}
+
+/* Read hash key. Strings are always interned. */
+static char *serialize_getkey(char *r, SBufExt *sbx, TValue *o)
+{
+  char *w = sbx->w, *rs;
+  uint32_t tp;
+  rs = serialize_ru124(r, w, &tp);
+  if (LJ_LIKELY(rs && tp >= SER_TAG_STR)) {
+    uint32_t len = tp - SER_TAG_STR;
+    if (LJ_UNLIKELY(len > (uint32_t)(w - rs)))
+      lj_err_caller(sbufL(sbx), LJ_ERR_BUFFER_EOB);
+    setstrV(sbufL(sbx), o, lj_str_new(sbufL(sbx), rs, len));
+    return rs + len;
+  }
+  return serialize_get(r, sbx, o);
+}
+
+/* Read packed array elements. Returns pointer past the last element. */
+static char *serialize_getpack(char *r, SBufExt *sbx, TValue **poa,
+			       TValue *oe)
+{
+  char *w = sbx->w;
+  TValue *oa = *poa;
+  uint32_t tp = (uint8_t)*r++, n;
+  MSize sz = tp == SER_TAG_PACK_U8 ? 1 : tp == SER_TAG_PACK_INT ? 4 : 8;
+  r = serialize_ru124(r, w, &n); if (LJ_UNLIKELY(!r)) goto eob;
+  if (LJ_UNLIKELY(n > (uint32_t)(oe - oa)))
+    lj_err_callerv(sbufL(sbx), LJ_ERR_BUFFER_BADDEC, tp);
+  if (LJ_UNLIKELY((uint64_t)n*sz > (uint64_t)(w - r))) goto eob;
+  *poa = oa + n;
+  if (tp == SER_TAG_PACK_U8) {
+    for (; n; n--) setintV(oa++, (int32_t)(uint8_t)*r++);
+  } else if (tp == SER_TAG_PACK_INT) {
+    for (; n; n--, r += 4)
+      setintV(oa++, (int32_t)(LJ_BE ? lj_bswap(lj_getu32(r)) : lj_getu32(r)));
+  } else if (tp == SER_TAG_PACK_NUM) {
+    memcpy(oa, r, n*8); r += n*8;
+    for (; n; n--, oa++) {
+#if LJ_BE
+      oa->u64 = lj_bswap64(oa->u64);
+#endif
+      if (!tvisnum(oa)) setnanV(oa);  /* Fix non-canonical NaNs. */
+    }
+#if LJ_HASFFI
+  } else {
+    CTypeID id = tp == SER_TAG_PACK_INT64 ? CTID_INT64 : CTID_UINT64;
+    if (LJ_UNLIKELY(!ctype_ctsG(G(sbufL(sbx)))))
+      lj_err_callerv(sbufL(sbx), LJ_ERR_BUFFER_BADDEC, tp);
+    for (; n; n--, r += 8) {
+      GCcdata *cd = lj_cdata_new_(sbufL(sbx), id, 8);
+      uint64_t x;
+      memcpy(&x, r, 8);
+      *(uint64_t *)cdataptr(cd) = LJ_BE ? lj_bswap64(x) : x;
+      setcdataV(sbufL(sbx), oa++, cd);
+    }
+#endif
+  }
+  return r;
+eob:
+  lj_err_caller(sbufL(sbx), LJ_ERR_BUFFER_EOB);
+  return NULL;
+}
+
 /* Get serialized object from buffer. */
 static char *serialize_get(char *r, SBufExt *sbx, TValue *o)
 {
@@ -343,7 +836,10 @@ static char *serialize_get(char *r, SBufExt *sbx, TValue *o)
   if (LJ_LIKELY(tp >= SER_TAG_STR)) {
     uint32_t len = tp - SER_TAG_STR;
     if (LJ_UNLIKELY(len > (uint32_t)(w - r))) goto eob;
-    setstrV(sbufL(sbx), o, lj_str_new(sbufL(sbx), r, len));
+    if (LJ_UNLIKELY(serialize_islazy(sbx, len)))
+      serialize_getview(sbx, r, len, o);
+    else
+      setstrV(sbufL(sbx), o, lj_str_new(sbufL(sbx), r, len));
     r += len;
   } else if (tp == SER_TAG_INT) {
     if (LJ_UNLIKELY(r + 4 > w)) goto eob;
@@ -396,15 +892,24 @@ static char *serialize_get(char *r, SBufExt *sbx, TValue *o)
     /* NOBARRIER: The table is new (marked white). */
     setgcref(t->metatable, obj2gco(mt));
     settabV(sbufL(sbx), o, t);
+    if (LJ_UNLIKELY(tabref(sbx->refs)))
+      serialize_setref(sbx, sbx->nref++, obj2gco(t));
     if (narray) {
       TValue *oa = tvref(t->array) + (tp >= SER_TAG_TAB+4);
       TValue *oe = tvref(t->array) + narray;
-      while (oa < oe) r = serialize_get(r, sbx, oa++);
+      while (oa < oe) {
+	uint32_t ptp = r < sbx->w ? (uint8_t)*r : 0;
+	if (ptp >= SER_TAG_PACK_U8 &&
+	    ptp <= (LJ_HASFFI ? SER_TAG_PACK_UINT64 : SER_TAG_PACK_NUM))
+	  r = serialize_getpack(r, sbx, &oa, oe);
+	else
+	  r = serialize_get(r, sbx, oa++);
+      }
     }
     if (nhash) {
       do {
 	TValue k, *v;
-	r = serialize_get(r, sbx, &k);
+	r = serialize_getkey(r, sbx, &k);
 	v = lj_tab_set(sbufL(sbx), t, &k);
 	if (LJ_UNLIKELY(!tvisnil(v)))
 	  lj_err_caller(sbufL(sbx), LJ_ERR_BUFFER_DUPKEY);
@@ -454,6 +959,8 @@ static char *serialize_get(char *r, SBufExt *sbx, TValue *o)
 #else
     setrawlightudV(o, (void *)ud);
 #endif
+  } else if (tp >= SER_TAG_REF && tp <= SER_TAG_MT && tabref(sbx->refs)) {
+    r = serialize_getobj(r, sbx, tp, o);
   } else {
 badtag:
     lj_err_callerv(sbufL(sbx), LJ_ERR_BUFFER_BADDEC, tp);
@@ -464,11 +971,508 @@ eob:
   return NULL;
 }
 
+/* -- Scanning ------------------------------------------------------------ */
+
+/* Check that n more bytes are available, else record the shortfall. */
+#define serialize_scanneed(r, w, n, need) \
+  do { \
+    if (LJ_UNLIKELY((uint64_t)(n) > (uint64_t)((w) - (r)))) { \
+      *(need) = (uint64_t)(n) - (uint64_t)((w) - (r)); \
+      return NULL; \
+    } \
+  } while (0)
+
+/* Scan U124 without decoding anything else. */
+static char *serialize_scanu124(char *r, char *w, uint32_t *pv,
+				uint64_t *need)
+{
+  uint32_t v;
+  serialize_scanneed(r, w, 1, need);
+  v = *(uint8_t *)r;
+  if (LJ_UNLIKELY(v >= 0xe0))
+    serialize_scanneed(r, w, v == 0xff ? 5 : 2, need);
+  return serialize_ru124(r, w, pv);
+}
+
+/* Skip over the encoding of one object. Returns a pointer past its end.
+** Returns NULL for a truncated object and sets *need to the number of
+** missing bytes, which is a lower bound. Malformed data is not diagnosed
+** here. It extends to the end of the buffer and is left to the decoder.
+*/
+static char *serialize_scan(char *r, char *w, int depth, uint64_t *need)
+{
+  uint32_t tp;
+  r = serialize_scanu124(r, w, &tp, need); if (!r) return NULL;
+  if (LJ_LIKELY(tp >= SER_TAG_STR)) {
+    serialize_scanneed(r, w, tp - SER_TAG_STR, need);
+    return r + (tp - SER_TAG_STR);
+  } else if (tp == SER_TAG_INT || tp == SER_TAG_LIGHTUD32) {
+    serialize_scanneed(r, w, 4, need);
+    return r + 4;
+  } else if (tp == SER_TAG_NUM || tp == SER_TAG_LIGHTUD64 ||
+	     tp == SER_TAG_INT64 || tp == SER_TAG_UINT64) {
+    serialize_scanneed(r, w, 8, need);
+    return r + 8;
+  } else if (tp == SER_TAG_COMPLEX) {
+    serialize_scanneed(r, w, 16, need);
+    return r + 16;
+  } else if (tp <= SER_TAG_NULL) {
+    return r;
+  } else if (tp == SER_TAG_DICT_STR) {
+    return serialize_scanu124(r, w, &tp, need);
+  } else if (tp >= SER_TAG_TAB && tp <= SER_TAG_DICT_MT && depth > 0) {
+    uint32_t narray = 0, nhash = 0;
+    if (tp == SER_TAG_DICT_MT) {
+      r = serialize_scanu124(r, w, &tp, need); if (!r) return NULL;
+      r = serialize_scanu124(r, w, &tp, need); if (!r) return NULL;
+      if (!(tp >= SER_TAG_TAB && tp < SER_TAG_DICT_MT)) return w;
+    }
+    if (tp >= SER_TAG_TAB+2) {
+      r = serialize_scanu124(r, w, &narray, need); if (!r) return NULL;
+      if (tp >= SER_TAG_TAB+4) {
+	if (!narray) return w;
+	narray--;
+      }
+    }
+    if ((tp & 1)) {
+      r = serialize_scanu124(r, w, &nhash, need); if (!r) return NULL;
+    }
+    while (narray) {
+      uint32_t ptp = r < w ? (uint8_t)*r : 0;
+      if (ptp >= SER_TAG_PACK_U8 && ptp <= SER_TAG_PACK_UINT64) {
+	uint32_t n;
+	uint64_t sz = ptp == SER_TAG_PACK_U8 ? 1 :
+		      ptp == SER_TAG_PACK_INT ? 4 : 8;
+	r = serialize_scanu124(r+1, w, &n, need); if (!r) return NULL;
+	if (n > narray) return w;
+	serialize_scanneed(r, w, n*sz, need);
+	r += n*sz;
+	narray -= n;
+      } else {
+	r = serialize_scan(r, w, depth-1, need); if (!r) return NULL;
+	narray--;
+      }
+    }
+    for (; nhash; nhash--) {
+      r = serialize_scan(r, w, depth-1, need); if (!r) return NULL;
+      r = serialize_scan(r, w, depth-1, need); if (!r) return NULL;
+    }
+    return r;
+  }
+  return w;  /* Malformed. */
+}
+
+/* -- JSON codec ---------------------------------------------------------- */
+
+#define json_isws(c)	((c) == ' ' || (c) == '\n' || (c) == '\r' || (c) == '\t')
+
+/* Check whether any of 8 bytes is a control char, '"' or '\\'. */
+static LJ_AINLINE uint64_t json_hasesc(uint64_t v)
+{
+  uint64_t q = v ^ U64x(22222222,22222222), b = v ^ U64x(5c5c5c5c,5c5c5c5c);
+  return (((v - U64x(20202020,20202020)) & ~v) |
+	  ((q - U64x(01010101,01010101)) & ~q) |
+	  ((b - U64x(01010101,01010101)) & ~b)) & U64x(80808080,80808080);
+}
+
+/* Skip a run of bytes which need no escaping. */
+static const char *json_skipraw(const char *p, const char *e)
+{
+  while (p + 8 <= e) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    if (json_hasesc(v)) break;
+    p += 8;
+  }
+  for (; p < e; p++) {
+    uint32_t c = (uint8_t)*p;
+    if (c < 0x20 || c == '"' || c == '\\') break;
+  }
+  return p;
+}
+
+static char *json_put(char *w, SBufExt *sbx, cTValue *o);
+
+/* Drop partial output and throw an encoding error. */
+LJ_NORET LJ_NOINLINE static void json_encerr(SBufExt *sbx, ErrMsg em,
+					       const char *s)
+{
+  sbx->w = sbx->b + sbx->jmark;
+  lj_err_callerv(sbufL(sbx), em, s);
+}
+
+/* Write quoted and escaped string. */
+static char *json_putstr(char *w, SBufExt *sbx, const char *s, MSize len)
+{
+  const char *e = s + len;
+  w = serialize_more(w, sbx, len+2);
+  *w++ = '"';
+  for (;;) {
+    const char *q = json_skipraw(s, e);
+    uint32_t c;
+    w = lj_buf_wmem(w, s, (MSize)(q - s));
+    if (q == e) break;
+    c = (uint8_t)*q;
+    s = q+1;
+    /* Room for the escape, the rest of the string and the closing quote. */
+    w = serialize_more(w, sbx, 6+1 + (MSize)(e - s));
+    *w++ = '\\';
+    switch (c) {
+    case '"': case '\\': *w++ = (char)c; break;
+    case '\b': *w++ = 'b'; break;
+    case '\f': *w++ = 'f'; break;
+    case '\n': *w++ = 'n'; break;
+    case '\r': *w++ = 'r'; break;
+    case '\t': *w++ = 't'; break;
+    default:
+      *w++ = 'u'; *w++ = '0'; *w++ = '0';
+      *w++ = "0123456789abcdef"[c >> 4]; *w++ = "0123456789abcdef"[c & 15];
+      break;
+    }
+  }
+  *w++ = '"';
+  return w;
+}
+
+/* Write number. Non-integers use the shortest of %.15g to %.17g that
+** reads back as the same number.
+*/
+static char *json_putnum(char *w, SBufExt *sbx, cTValue *o)
+{
+  SFormat sf = STRFMT_G | ((15+1) << STRFMT_SH_PREC);
+  lua_Number n;
+  int32_t k;
+  w = serialize_more(w, sbx, STRFMT_MAXBUF_NUM+1);
+  if (tvisint(o)) return lj_strfmt_wint(w, intV(o));
+  n = numV(o);
+  k = lj_num2int(n);
+  if (n == (lua_Number)k && !tvismzero(o)) return lj_strfmt_wint(w, k);
+  if (n > -9007199254740992.0 && n < 9007199254740992.0 &&
+      n == (lua_Number)(int64_t)n)  /* Other integers up to 2^53. */
+    return lj_strfmt_wfnum(NULL, STRFMT_F | ((0+1) << STRFMT_SH_PREC), n, w);
+  if (LJ_UNLIKELY((o->u32.hi << 1) >= 0xffe00000))
+    json_encerr(sbx, LJ_ERR_BUFFER_BADENC, n != n ? "nan" : "inf");
+  for (;;) {  /* Write in place, there's enough room. */
+    TValue tv;
+    char *q = lj_strfmt_wfnum(NULL, sf, n, w);
+    if (STRFMT_PREC(sf) == 17) return q;
+    *q = '\0';
+    if (lj_strscan_scan((const uint8_t *)w, (MSize)(q - w), &tv,
+			STRSCAN_OPT_TONUM) == STRSCAN_NUM && tv.n == n)
+      return q;
+    sf += (1 << STRFMT_SH_PREC);
+  }
+}
+
+/* Write object key. Only strings and numbers are allowed. */
+static char *json_putkey(char *w, SBufExt *sbx, cTValue *k)
+{
+  if (LJ_LIKELY(tvisstr(k))) {
+    w = json_putstr(w, sbx, strdata(strV(k)), strV(k)->len);
+  } else if (tvisnumber(k)) {
+    w = serialize_more(w, sbx, 1);
+    *w++ = '"';
+    w = json_putnum(w, sbx, k);
+    w = serialize_more(w, sbx, 1);
+    *w++ = '"';
+  } else {
+    json_encerr(sbx, LJ_ERR_BUFFER_BADENC, lj_typename(k));
+  }
+  w = serialize_more(w, sbx, 1);
+  *w++ = ':';
+  return w;
+}
+
+/* Write table. Tables with only positive integer keys are arrays, unless
+** they are too sparse. Holes are written as null.
+*/
+static char *json_puttab(char *w, SBufExt *sbx, GCtab *t)
+{
+  TValue *array = tvref(t->array);
+  Node *node = noderef(t->node);
+  uint32_t i, n = 0, nmax = 0, hmask = t->hmask;
+  int isarr = !(t->asize && !tvisnil(&array[0])), first = 1;
+  if (sbx->depth <= 0) json_encerr(sbx, LJ_ERR_BUFFER_DEPTH, NULL);
+  sbx->depth--;
+  for (i = 1; i < t->asize; i++)
+    if (!tvisnil(&array[i])) n++, nmax = i;
+  for (i = 0; isarr && hmask && i <= hmask; i++) {
+    cTValue *k = &node[i].key;
+    if (!tvisnil(&node[i].val)) {
+      lua_Number kn = tvisint(k) ? (lua_Number)intV(k) :
+		      tvisnum(k) ? numV(k) : 0;
+      int32_t ki = lj_num2int(kn);
+      if (!(kn == (lua_Number)ki && ki > 0)) isarr = 0;
+      n++;
+      if ((uint32_t)ki > nmax) nmax = (uint32_t)ki;
+    }
+  }
+  if (isarr && n && nmax <= 2*n) {
+    w = serialize_more(w, sbx, 1);
+    *w++ = '[';
+    for (i = 1; i <= nmax; i++) {
+      cTValue *o = i < t->asize ? &array[i] : lj_tab_getint(t, (int32_t)i);
+      if (i > 1) { w = serialize_more(w, sbx, 1); *w++ = ','; }
+      w = json_put(w, sbx, o ? o : niltv(sbufL(sbx)));  /* Hole in hash. */
+    }
+    w = serialize_more(w, sbx, 1);
+    *w++ = ']';
+  } else {
+    w = serialize_more(w, sbx, 1);
+    *w++ = '{';
+    for (i = 0; i < t->asize; i++) {
+      if (!tvisnil(&array[i])) {
+	TValue k;
+	if (!first) { w = serialize_more(w, sbx, 1); *w++ = ','; }
+	first = 0;
+	setintV(&k, (int32_t)i);
+	w = json_putkey(w, sbx, &k);
+	w = json_put(w, sbx, &array[i]);
+      }
+    }
+    for (i = 0; hmask && i <= hmask; i++) {
+      if (!tvisnil(&node[i].val)) {
+	if (!first) { w = serialize_more(w, sbx, 1); *w++ = ','; }
+	first = 0;
+	w = json_putkey(w, sbx, &node[i].key);
+	w = json_put(w, sbx, &node[i].val);
+      }
+    }
+    w = serialize_more(w, sbx, 1);
+    *w++ = '}';
+  }
+  sbx->depth++;
+  return w;
+}
+
+static char *json_put(char *w, SBufExt *sbx, cTValue *o)
+{
+  if (LJ_LIKELY(tvisstr(o))) {
+    return json_putstr(w, sbx, strdata(strV(o)), strV(o)->len);
+  } else if (tvisnumber(o)) {
+    return json_putnum(w, sbx, o);
+  } else if (tvisnil(o) || lj_obj_equal(o, &sbx->jnull) ||
+	     (tvislightud(o) && !lightudV(G(sbufL(sbx)), o))) {
+    w = serialize_more(w, sbx, 4);
+    return lj_buf_wmem(w, "null", 4);
+  } else if (tvistab(o)) {
+    return json_puttab(w, sbx, tabV(o));
+  } else if (tvisbool(o)) {
+    w = serialize_more(w, sbx, 5);
+    return tvistrue(o) ? lj_buf_wmem(w, "true", 4) :
+			 lj_buf_wmem(w, "false", 5);
+  }
+  json_encerr(sbx, LJ_ERR_BUFFER_BADENC, lj_typename(o));
+  return w;
+}
+
+/* Throw error for malformed or incomplete JSON at r. */
+LJ_NORET LJ_NOINLINE static void json_err(SBufExt *sbx, char *r)
+{
+  if (r >= sbx->w) lj_err_caller(sbufL(sbx), LJ_ERR_BUFFER_EOB);
+  lj_err_callerv(sbufL(sbx), LJ_ERR_BUFFER_BADJSON, (int32_t)(r - sbx->r));
+}
+
+static LJ_AINLINE char *json_skipws(char *r, char *w)
+{
+  while (r < w && json_isws(*r)) r++;
+  return r;
+}
+
+/* Read 4 hex digits of a \u escape. */
+static uint32_t json_gethex4(SBufExt *sbx, char *r)
+{
+  uint32_t i, c = 0;
+  if (sbx->w - r < 4) json_err(sbx, sbx->w);
+  for (i = 0; i < 4; i++) {
+    uint32_t d = (uint8_t)r[i];
+    if (!lj_char_isxdigit(d)) json_err(sbx, r+i);
+    c = (c << 4) + (d <= '9' ? d - '0' : (d | 0x20) - 'a' + 10);
+  }
+  return c;
+}
+
+/* Read string. r points after the opening quote. Keys are never views. */
+static char *json_getstr(char *r, SBufExt *sbx, TValue *o, int key)
+{
+  lua_State *L = sbufL(sbx);
+  char *w = sbx->w, *q = (char *)json_skipraw(r, w);
+  SBuf *sb;
+  if (LJ_LIKELY(q < w && *q == '"')) {  /* Fast path: no escapes. */
+    MSize len = (MSize)(q - r);
+    if (LJ_UNLIKELY(!key && serialize_islazy(sbx, len)))
+      serialize_getview(sbx, r, len, o);
+    else
+      setstrV(L, o, lj_str_new(L, r, len));
+    return q+1;
+  }
+  sb = lj_buf_tmp_(L);
+  for (;;) {
+    uint32_t c;
+    char *p;
+    lj_buf_putmem(sb, r, (MSize)(q - r));
+    if (q >= w) json_err(sbx, q);
+    if (*q == '"') break;
+    if (*q != '\\') json_err(sbx, q);  /* Control char. */
+    if (++q >= w) json_err(sbx, q);
+    switch (*q++) {
+    case '"': c = '"'; break;
+    case '\\': c = '\\'; break;
+    case '/': c = '/'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'u':
+      c = json_gethex4(sbx, q); q += 4;
+      if (c >= 0xd800 && c < 0xdc00 && w - q >= 6 && q[0] == '\\' &&
+	  q[1] == 'u') {  /* Combine surrogate pair. */
+	uint32_t c2 = json_gethex4(sbx, q+2);
+	if (c2 >= 0xdc00 && c2 < 0xe000) {
+	  c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+	  q += 6;
+	}
+      }
+      if (c >= 0xd800 && c < 0xe000)
+	c = 0xfffd;  /* Replace lone surrogate, it's not valid UTF-8. */
+      break;
+    default:
+      json_err(sbx, q-1);
+      c = 0;
+      break;
+    }
+    p = lj_buf_more(sb, 4);
+    if (c < 0x80) {
+      *p++ = (char)c;
+    } else if (c < 0x800) {
+      *p++ = (char)(0xc0 | (c >> 6)); *p++ = (char)(0x80 | (c & 0x3f));
+    } else if (c < 0x10000) {
+      *p++ = (char)(0xe0 | (c >> 12));
+      *p++ = (char)(0x80 | ((c >> 6) & 0x3f)); *p++ = (char)(0x80 | (c & 0x3f));
+    } else {
+      *p++ = (char)(0xf0 | (c >> 18)); *p++ = (char)(0x80 | ((c >> 12) & 0x3f));
+      *p++ = (char)(0x80 | ((c >> 6) & 0x3f)); *p++ = (char)(0x80 | (c & 0x3f));
+    }
+    sb->w = p;
+    r = q;
+    q = (char *)json_skipraw(r, w);
+  }
+  setstrV(L, o, lj_str_new(L, sb->b, sbuflen(sb)));
+  return q+1;
+}
+
+/* Read number. Simple integers are converted on-the-fly. */
+static char *json_getnum(char *r, SBufExt *sbx, TValue *o)
+{
+  char *w = sbx->w, *p = r;
+  uint32_t x = 0, dig = 0;
+  int isint = 1;
+  if (*p == '-') p++;
+  if (p < w && *p == '0') {
+    p++, dig++;
+  } else {
+    for (; p < w && lj_char_isdigit((uint8_t)*p); p++, dig++)
+      x = x * 10 + (*p & 15);
+  }
+  if (!dig) json_err(sbx, p);
+  if (p < w && *p == '.') {
+    isint = 0;
+    if (!(++p < w && lj_char_isdigit((uint8_t)*p))) json_err(sbx, p);
+    while (p < w && lj_char_isdigit((uint8_t)*p)) p++;
+  }
+  if (p < w && (*p | 0x20) == 'e') {
+    isint = 0;
+    if (++p < w && (*p == '+' || *p == '-')) p++;
+    if (!(p < w && lj_char_isdigit((uint8_t)*p))) json_err(sbx, p);
+    while (p < w && lj_char_isdigit((uint8_t)*p)) p++;
+  }
+  if (isint && dig <= 9) {
+    if (*r != '-') setintV(o, (int32_t)x);
+    else if (x) setintV(o, -(int32_t)x);
+    else setnumV(o, -0.0);
+  } else {
+    MSize len = (MSize)(p - r);
+    char nb[64], *s = len < sizeof(nb) ? nb : lj_buf_tmp(sbufL(sbx), len+1);
+    StrScanFmt fmt;
+    memcpy(s, r, len);
+    s[len] = '\0';
+    fmt = lj_strscan_scan((const uint8_t *)s, len, o,
+			  LJ_DUALNUM ? STRSCAN_OPT_TOINT : STRSCAN_OPT_TONUM);
+    if (LJ_DUALNUM && fmt == STRSCAN_INT) setitype(o, LJ_TISNUM);
+    else if (fmt != STRSCAN_NUM) json_err(sbx, r);
+  }
+  return p;
+}
+
+static char *json_get(char *r, SBufExt *sbx, TValue *o)
+{
+  lua_State *L = sbufL(sbx);
+  char *w = sbx->w;
+  uint32_t c;
+  if (r >= w) json_err(sbx, r);
+  c = (uint8_t)*r;
+  if (c == '"') {
+    return json_getstr(r+1, sbx, o, 0);
+  } else if (c == '-' || lj_char_isdigit(c)) {
+    return json_getnum(r, sbx, o);
+  } else if (c == '[' || c == '{') {
+    GCtab *t;
+    if (sbx->depth <= 0) lj_err_caller(L, LJ_ERR_BUFFER_DEPTH);
+    sbx->depth--;
+    t = lj_tab_new(L, 0, 0);
+    settabV(L, o, t);
+    r = json_skipws(r+1, w);
+    if (r < w && (uint8_t)*r == c+2) {  /* Empty [] or {}. */
+      r++;
+    } else if (c == '[') {
+      int32_t i = 0;
+      for (;;) {
+	/* NOBARRIER: The table is new (marked white). */
+	i++;
+	r = json_skipws(json_get(r, sbx, lj_tab_setint(L, t, i)), w);
+	if (r < w && *r == ',') r = json_skipws(r+1, w);
+	else if (r < w && *r == ']') break;
+	else json_err(sbx, r);
+      }
+      r++;
+    } else {
+      for (;;) {
+	TValue k;
+	if (!(r < w && *r == '"')) json_err(sbx, r);
+	r = json_skipws(json_getstr(r+1, sbx, &k, 1), w);
+	if (!(r < w && *r == ':')) json_err(sbx, r);
+	r = json_skipws(r+1, w);
+	/* NOBARRIER: The table is new (marked white). */
+	r = json_skipws(json_get(r, sbx, lj_tab_set(L, t, &k)), w);
+	if (r < w && *r == ',') r = json_skipws(r+1, w);
+	else if (r < w && *r == '}') break;
+	else json_err(sbx, r);
+      }
+      r++;
+    }
+    sbx->depth++;
+    return r;
+  } else if (c == 't' && w - r >= 4 && !memcmp(r, "true", 4)) {
+    setboolV(o, 1);
+    return r+4;
+  } else if (c == 'f' && w - r >= 5 && !memcmp(r, "false", 5)) {
+    setboolV(o, 0);
+    return r+5;
+  } else if (c == 'n' && w - r >= 4 && !memcmp(r, "null", 4)) {
+    copyTV(L, o, &sbx->jnull);
+    return r+4;
+  }
+  json_err(sbx, r);
+  return NULL;
+}
+
 /* -- External serialization API ------------------------------------------ */
 
 /* Encode to buffer. */
 SBufExt * LJ_FASTCALL lj_serialize_put(SBufExt *sbx, cTValue *o)
 {
+  setgcrefnull(sbx->refs);  /* May be stale after an error. */
   sbx->depth = LJ_SERIALIZE_DEPTH;
   sbx->w = serialize_put(sbx->w, sbx, o);
   return sbx;
@@ -477,10 +1481,65 @@ SBufExt * LJ_FASTCALL lj_serialize_put(SBufExt *sbx, cTValue *o)
 /* Decode from buffer. */
 char * LJ_FASTCALL lj_serialize_get(SBufExt *sbx, TValue *o)
 {
+  setgcrefnull(sbx->refs);  /* May be stale after an error. */
   sbx->depth = LJ_SERIALIZE_DEPTH;
   return serialize_get(sbx->r, sbx, o);
 }
 
+/* Get size of the next encoded object in the buffer.
+** Returns 0 if the object is incomplete and sets *need to a lower bound
+** for its size.
+*/
+MSize lj_serialize_size(SBufExt *sbx, MSize *need)
+{
+  uint64_t more = 0;
+  char *r = serialize_scan(sbx->r, sbx->w, LJ_SERIALIZE_DEPTH, &more);
+  if (r) return (MSize)(r - sbx->r);
+  more += (uint64_t)(sbx->w - sbx->r);
+  *need = more < LJ_MAX_BUF ? (MSize)more : LJ_MAX_BUF;
+  return 0;
+}
+
+/* Snapshot object graph to buffer. */
+SBufExt *lj_serialize_snapshot(SBufExt *sbx, cTValue *o)
+{
+  lua_State *L = sbufL(sbx);
+  TValue tv;
+  char *w;
+  copyTV(L, &tv, o);
+  serialize_refs_new(L, sbx, 1);
+  sbx->depth = LJ_SERIALIZE_DEPTH;
+  w = serialize_more(sbx->w, sbx, 1+5);
+  *w++ = SER_TAG_SNAP;
+  w = serialize_wu124(w, sbx->nref);  /* Object dictionary length. */
+  sbx->w = serialize_put(w, sbx, &tv);
+  setgcrefnull(sbx->refs);
+  L->top--;
+  return sbx;
+}
+
+/* Restore object graph from buffer. The stack may be reallocated. */
+char *lj_serialize_restore(SBufExt *sbx, TValue *o)
+{
+  lua_State *L = sbufL(sbx);
+  char *r = sbx->r, *w = sbx->w;
+  uint32_t tp, ndict;
+  r = serialize_ru124(r, w, &tp);
+  if (LJ_UNLIKELY(!r)) lj_err_caller(L, LJ_ERR_BUFFER_EOB);
+  if (tp != SER_TAG_SNAP) lj_err_callerv(L, LJ_ERR_BUFFER_BADDEC, tp);
+  r = serialize_ru124(r, w, &ndict);
+  if (LJ_UNLIKELY(!r)) lj_err_caller(L, LJ_ERR_BUFFER_EOB);
+  serialize_refs_new(L, sbx, 0);
+  /* Reference numbers are only valid with the same object dictionary. */
+  if (ndict != sbx->nref)
+    lj_err_callerv(L, LJ_ERR_BUFFER_BADREF, (int32_t)ndict);
+  sbx->depth = LJ_SERIALIZE_DEPTH;
+  r = serialize_get(r, sbx, o);
+  setgcrefnull(sbx->refs);
+  L->top--;
+  return r;
+}
+
 /* Stand-alone encoding, borrowing from global temporary buffer. */
 GCstr * LJ_FASTCALL lj_serialize_encode(lua_State *L, cTValue *o)
 {
@@ -506,6 +1565,55 @@ void lj_serialize_decode(lua_State *L, TValue *o, GCstr *str)
   if (r != sbx.w) lj_err_caller(L, LJ_ERR_BUFFER_LEFTOV);
 }
 
+/* Encode JSON to buffer. */
+SBufExt * LJ_FASTCALL lj_serialize_putjson(SBufExt *sbx, cTValue *o)
+{
+  sbx->depth = LJ_SERIALIZE_DEPTH;
+  sbx->jmark = sbuflen(sbx);
+  sbx->w = json_put(sbx->w, sbx, o);
+  return sbx;
+}
+
+/* Decode JSON from buffer. Skips whitespace before and after the value. */
+char * LJ_FASTCALL lj_serialize_getjson(SBufExt *sbx, TValue *o)
+{
+  char *r = json_skipws(sbx->r, sbx->w);
+  sbx->depth = LJ_SERIALIZE_DEPTH;
+  return json_skipws(json_get(r, sbx, o), sbx->w);
+}
+
+/* Get size of the next complete JSON value, including whitespace before.
+** Returns 0 if there's only whitespace or an incomplete value. A number or
+** literal at the very end is incomplete, since more digits might follow.
+** Malformed input is left to the decoder to report.
+*/
+MSize lj_serialize_sizejson(SBufExt *sbx)
+{
+  char *r = json_skipws(sbx->r, sbx->w), *w = sbx->w;
+  uint32_t depth = 0;
+  if (r >= w) return 0;
+  do {
+    uint32_t c = (uint8_t)*r++;
+    if (c == '"') {
+      while (r < w && *r != '"') r += (*r == '\\') ? 2 : 1;
+      if (r >= w) return 0;
+      r++;
+    } else if (c == '[' || c == '{') {
+      depth++;
+    } else if (c == ']' || c == '}') {
+      if (!depth) break;
+      depth--;
+    } else if (!depth) {  /* Top-level number or literal. */
+      while (r < w && (lj_char_isident((uint8_t)*r) || *r == '+' ||
+		       *r == '-' || *r == '.'))
+	r++;
+      if (r >= w) return 0;
+      break;
+    }
+  } while (depth && r < w);
+  return depth ? 0 : (MSize)(r - sbx->r);
+}
+
 #if LJ_HASJIT
 /* Peek into buffer to find the result IRType for specialization purposes. */
 LJ_FUNC MSize LJ_FASTCALL lj_serialize_peektype(SBufExt *sbx)
@@ -528,12 +1636,81 @@ LJ_FUNC MSize LJ_FASTCALL lj_serialize_peektype(SBufExt *sbx)
     case SER_TAG_INT64: case SER_TAG_UINT64: case SER_TAG_COMPLEX:
       return IRT_CDATA;
     case SER_TAG_DICT_STR:
+      return IRT_STR;
     default:
+      if (tp >= SER_TAG_STR && serialize_islazy(sbx, tp - SER_TAG_STR))
+	return IRT_UDATA;
       return IRT_STR;
     }
   }
   return IRT_NIL;  /* Will fail on actual decode. */
 }
+
+/* -- Specialized table encoding for the recorder ------------------------- */
+
+/* Count number of used hash slots. */
+uint32_t LJ_FASTCALL lj_serialize_nhash(GCtab *t)
+{
+  uint32_t i, hmask = t->hmask, nhash = 0;
+  Node *node = noderef(t->node);
+  for (i = 0; i <= hmask; i++)
+    nhash += !tvisnil(&node[i].val);
+  return nhash;
+}
+
+/* Write constant encoding of a string, a primitive or a table header.
+** Tables must not have an array part, a metatable or non-string keys.
+*/
+char *lj_serialize_wconst(char *w, cTValue *o)
+{
+  if (tvisstr(o)) {
+    const GCstr *str = strV(o);
+    w = serialize_wu124(w, SER_TAG_STR + str->len);
+    w = lj_buf_wmem(w, strdata(str), str->len);
+  } else if (tvispri(o)) {
+    *w++ = (char)(SER_TAG_NIL + ~itype(o));
+  } else {
+    uint32_t nhash = lj_serialize_nhash(tabV(o));
+    lj_assertX(tabV(o)->asize == 0 && !tabref(tabV(o)->metatable),
+	       "bad table for constant encoding");
+    *w++ = (char)(SER_TAG_TAB + (nhash ? 1 : 0));
+    if (nhash) w = serialize_wu124(w, nhash);
+  }
+  return w;
+}
+
+/* Append tagged string. */
+SBuf * LJ_FASTCALL lj_serialize_putstr(SBuf *sb, GCstr *str)
+{
+  MSize len = str->len;
+  char *w = lj_buf_more(sb, 5+len);
+  w = serialize_wu124(w, SER_TAG_STR + len);
+  sb->w = lj_buf_wmem(w, strdata(str), len);
+  return sb;
+}
+
+/* Append tagged integer. */
+SBuf * LJ_FASTCALL lj_serialize_putint(SBuf *sb, int32_t k)
+{
+  uint32_t x = LJ_BE ? lj_bswap((uint32_t)k) : (uint32_t)k;
+  char *w = lj_buf_more(sb, 1+4);
+  *w++ = SER_TAG_INT; memcpy(w, &x, 4);
+  sb->w = w + 4;
+  return sb;
+}
+
+/* Append tagged number. */
+SBuf *lj_serialize_putnum(SBuf *sb, lua_Number n)
+{
+  TValue o;
+  uint64_t x;
+  char *w = lj_buf_more(sb, 1+sizeof(lua_Number));
+  o.n = n;
+  x = LJ_BE ? lj_bswap64(o.u64) : o.u64;
+  *w++ = SER_TAG_NUM; memcpy(w, &x, 8);
+  sb->w = w + 8;
+  return sb;
+}
 #endif
 
 #endif
@@ -12,15 +12,28 @@
 #if LJ_HASBUFFER
 
 #define LJ_SERIALIZE_DEPTH	100	/* Default depth. */
+#define LJ_SERIALIZE_LAZYSTR	128	/* Default min. length for lazystr. */
 
 LJ_FUNC void LJ_FASTCALL lj_serialize_dict_prep_str(lua_State *L, GCtab *dict);
 LJ_FUNC void LJ_FASTCALL lj_serialize_dict_prep_mt(lua_State *L, GCtab *dict);
+LJ_FUNC void LJ_FASTCALL lj_serialize_dict_check_obj(lua_State *L, GCtab *dict);
 LJ_FUNC SBufExt * LJ_FASTCALL lj_serialize_put(SBufExt *sbx, cTValue *o);
 LJ_FUNC char * LJ_FASTCALL lj_serialize_get(SBufExt *sbx, TValue *o);
 LJ_FUNC GCstr * LJ_FASTCALL lj_serialize_encode(lua_State *L, cTValue *o);
 LJ_FUNC void lj_serialize_decode(lua_State *L, TValue *o, GCstr *str);
+LJ_FUNC MSize lj_serialize_size(SBufExt *sbx, MSize *need);
+LJ_FUNC SBufExt * LJ_FASTCALL lj_serialize_putjson(SBufExt *sbx, cTValue *o);
+LJ_FUNC char * LJ_FASTCALL lj_serialize_getjson(SBufExt *sbx, TValue *o);
+LJ_FUNC MSize lj_serialize_sizejson(SBufExt *sbx);
+LJ_FUNC SBufExt *lj_serialize_snapshot(SBufExt *sbx, cTValue *o);
+LJ_FUNC char *lj_serialize_restore(SBufExt *sbx, TValue *o);
 #if LJ_HASJIT
 LJ_FUNC MSize LJ_FASTCALL lj_serialize_peektype(SBufExt *sbx);
+LJ_FUNC uint32_t LJ_FASTCALL lj_serialize_nhash(GCtab *t);
+LJ_FUNC char *lj_serialize_wconst(char *w, cTValue *o);
+LJ_FUNC SBuf * LJ_FASTCALL lj_serialize_putstr(SBuf *sb, GCstr *str);
+LJ_FUNC SBuf * LJ_FASTCALL lj_serialize_putint(SBuf *sb, int32_t k);
+LJ_FUNC SBuf *lj_serialize_putnum(SBuf *sb, lua_Number n);
 #endif
 
 #endif
@@ -226,9 +226,14 @@ static void close_state(lua_State *L)
 	     "memory leak of %lld bytes",
 	     (long long)(g->gc.total - sizeof(GG_State)));
 #ifndef LUAJIT_USE_SYSMALLOC
-  if (g->allocf == lj_alloc_f)
-    lj_alloc_destroy(g->allocd);
-  else
+  if (g->allocf == lj_alloc_f) {
+    void *msp = g->allocd;
+#if LJ_ALLOCSHARED
+    /* The shared arena outlives the state. */
+    lj_alloc_f(msp, G2GG(g), sizeof(GG_State), 0);
+#endif
+    lj_alloc_destroy(msp);
+  } else
 #endif
     g->allocf(g->allocd, G2GG(g), sizeof(GG_State), 0);
 }
@@ -70,6 +70,98 @@ int lj_str_haspattern(GCstr *s)
   return 0;  /* No pattern matching chars found. */
 }
 
+/* -- UTF-8 --------------------------------------------------------------- */
+
+/* Byte classes for the validating UTF-8 DFA (RFC 3629). The class of a
+** lead byte doubles as the shift for the payload mask of that byte.
+*/
+static const uint8_t str_utf8class[256] = {
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,
+  1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+  7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+  8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,
+  10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3,11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8
+};
+
+#define STR_UTF8_ACCEPT	0
+#define STR_UTF8_REJECT	12
+
+/* DFA state transitions. States are premultiplied by the number of classes.
+** All states that still expect continuation bytes are above REJECT.
+*/
+static const uint8_t str_utf8trans[9*12] = {
+  0,12,24,36,60,96,84,12,12,12,48,72,	/* ACCEPT */
+  12,12,12,12,12,12,12,12,12,12,12,12,	/* REJECT */
+  12,0,12,12,12,12,12,0,12,0,12,12,	/* 1 continuation byte left. */
+  12,24,12,12,12,12,12,24,12,24,12,12,	/* 2 continuation bytes left. */
+  12,12,12,12,12,12,12,24,12,12,12,12,	/* After E0: no overlong. */
+  12,24,12,12,12,12,12,12,12,24,12,12,	/* After ED: no surrogates. */
+  12,12,12,12,12,12,12,36,12,36,12,12,	/* After F0: no overlong. */
+  12,36,12,12,12,12,12,36,12,36,12,12,	/* 3 continuation bytes left. */
+  12,36,12,12,12,12,12,12,12,12,12,12	/* After F4: max. U+10FFFF. */
+};
+
+/* Count UTF-8 chars starting in [p, q). The last one may extend up to e.
+** Returns q (or beyond) if valid, else the start of the invalid sequence.
+*/
+const char *lj_str_utf8scan(const char *p, const char *q, const char *e,
+			    MSize *np)
+{
+  MSize n = 0;
+  while (p < q) {
+    uint32_t c = *(const uint8_t *)p;
+    if (c < 0x80) {  /* Skip ASCII runs in bulk. */
+      const char *s = p;
+      for (p++; p+8 <= q; p += 8) {  /* 8 bytes at a time. */
+	uint64_t x;
+	memcpy(&x, p, 8);
+	if ((x & U64x(80808080,80808080))) break;
+      }
+      while (p < q && *(const uint8_t *)p < 0x80) p++;
+      n += (MSize)(p - s);
+    } else {
+      const uint8_t *s = (const uint8_t *)p+1;
+      uint32_t st = str_utf8trans[str_utf8class[c]];
+      while (st > STR_UTF8_REJECT && s < (const uint8_t *)e)
+	st = str_utf8trans[st + str_utf8class[*s++]];
+      if (st != STR_UTF8_ACCEPT) break;
+      p = (const char *)s;
+      n++;
+    }
+  }
+  *np = n;
+  return p;
+}
+
+/* Decode the UTF-8 char at p < e. Returns NULL if it's invalid. */
+const char *lj_str_utf8dec(const char *p, const char *e, uint32_t *cp)
+{
+  const uint8_t *s = (const uint8_t *)p;
+  uint32_t c = *s++, k = str_utf8class[c];
+  uint32_t st = str_utf8trans[k];
+  c &= 0xffu >> k;
+  while (st > STR_UTF8_REJECT && s < (const uint8_t *)e) {
+    uint32_t b = *s++;
+    st = str_utf8trans[st + str_utf8class[b]];
+    c = (c << 6) | (b & 0x3f);
+  }
+  if (st != STR_UTF8_ACCEPT) return NULL;
+  *cp = c;
+  return (const char *)s;
+}
+
+/* Number of UTF-8 chars in a string or ~offset of the first invalid one. */
+int32_t LJ_FASTCALL lj_str_utf8len(GCstr *s)
+{
+  const char *p = strdata(s), *e = p + s->len;
+  MSize n;
+  const char *q = lj_str_utf8scan(p, e, e, &n);
+  return q < e ? ~(int32_t)(q - p) : (int32_t)n;
+}
+
 /* -- String hashing ------------------------------------------------------ */
 
 /* Keyed sparse ARX string hash. Constant time. */
@@ -125,99 +217,111 @@ static LJ_NOINLINE StrHash hash_dense(uint64_t seed, StrHash h,
 
 #define LJ_STR_MAXCOLL		32
 
-/* Resize the string interning hash table (grow and shrink). */
-void lj_str_resize(lua_State *L, MSize newmask)
-{
-  global_State *g = G(L);
-  GCRef *newtab, *oldtab = g->str.tab;
-  MSize i;
-
-  /* No resizing during GC traversal or if already too big. */
-  if (g->gc.state == GCSsweepstring || newmask >= LJ_MAX_STRTAB-1)
-    return;
-
-  newtab = lj_mem_newvec(L, newmask+1, GCRef);
-  memset(newtab, 0, (newmask+1)*sizeof(GCRef));
+#define LJ_STR_MIGRATE		4	/* Old chains migrated per new string. */
 
+/* Reinsert a string into the string interning hash table. */
+static void str_reinsert(global_State *g, GCobj *o)
+{
+  GCRef *strtab = g->str.tab;
+  MSize strmask = g->str.mask;
+  GCstr *s = gco2str(o);
+  MSize hash = s->hash;
 #if LUAJIT_SECURITY_STRHASH
-  /* Check which chains need secondary hashes. */
-  if (g->str.second) {
-    int newsecond = 0;
-    /* Compute primary chain lengths. */
-    for (i = g->str.mask; i != ~(MSize)0; i--) {
-      GCobj *o = (GCobj *)(gcrefu(oldtab[i]) & ~(uintptr_t)1);
-      while (o) {
-	GCstr *s = gco2str(o);
-	MSize hash = s->hashalg ? hash_sparse(g->str.seed, strdata(s), s->len) :
-				  s->hash;
-	hash &= newmask;
-	setgcrefp(newtab[hash], gcrefu(newtab[hash]) + 1);
-	o = gcnext(o);
-      }
+  uintptr_t u;
+  if (LJ_LIKELY(!s->hashalg)) {  /* String hashed with primary hash. */
+    hash &= strmask;
+    u = gcrefu(strtab[hash]);
+    if (LJ_UNLIKELY(u & 1)) {  /* Switch string to secondary hash. */
+      s->hash = hash = hash_dense(g->str.seed, s->hash, strdata(s), s->len);
+      s->hashalg = 1;
+      hash &= strmask;
+      u = gcrefu(strtab[hash]);
     }
-    /* Mark secondary chains. */
-    for (i = newmask; i != ~(MSize)0; i--) {
-      int secondary = gcrefu(newtab[i]) > LJ_STR_MAXCOLL;
-      newsecond |= secondary;
-      setgcrefp(newtab[i], secondary);
+  } else {  /* String hashed with secondary hash. */
+    MSize shash = hash_sparse(g->str.seed, strdata(s), s->len);
+    u = gcrefu(strtab[shash & strmask]);
+    if (u & 1) {
+      hash &= strmask;
+      u = gcrefu(strtab[hash]);
+    } else {  /* Revert string back to primary hash. */
+      s->hash = shash;
+      s->hashalg = 0;
+      hash = (shash & strmask);
     }
-    g->str.second = newsecond;
   }
+  /* NOBARRIER: The string table is a GC root. */
+  setgcrefp(o->gch.nextgc, (u & ~(uintptr_t)1));
+  setgcrefp(strtab[hash], ((uintptr_t)o | (u & 1)));
+#else
+  hash &= strmask;
+  /* NOBARRIER: The string table is a GC root. */
+  setgcrefr(o->gch.nextgc, strtab[hash]);
+  setgcref(strtab[hash], o);
 #endif
+}
 
-  /* Reinsert all strings from the old table into the new table. */
-  for (i = g->str.mask; i != ~(MSize)0; i--) {
+/* Migrate some chains from the old to the new hash table. */
+void lj_str_migrate(global_State *g, MSize n)
+{
+  GCRef *oldtab = g->str.oldtab;
+  MSize i = g->str.migrate;
+  lj_assertG(oldtab && g->gc.state != GCSsweepstring, "bad string migration");
+  for (; n > 0 && i <= g->str.oldmask; n--, i++) {
     GCobj *o = (GCobj *)(gcrefu(oldtab[i]) & ~(uintptr_t)1);
+    /* Keep the secondary hash flag for the remaining strings of this chain. */
+    setgcrefp(oldtab[i], (gcrefu(oldtab[i]) & 1));
     while (o) {
       GCobj *next = gcnext(o);
-      GCstr *s = gco2str(o);
-      MSize hash = s->hash;
-#if LUAJIT_SECURITY_STRHASH
-      uintptr_t u;
-      if (LJ_LIKELY(!s->hashalg)) {  /* String hashed with primary hash. */
-	hash &= newmask;
-	u = gcrefu(newtab[hash]);
-	if (LJ_UNLIKELY(u & 1)) {  /* Switch string to secondary hash. */
-	  s->hash = hash = hash_dense(g->str.seed, s->hash, strdata(s), s->len);
-	  s->hashalg = 1;
-	  hash &= newmask;
-	  u = gcrefu(newtab[hash]);
-	}
-      } else {  /* String hashed with secondary hash. */
-	MSize shash = hash_sparse(g->str.seed, strdata(s), s->len);
-	u = gcrefu(newtab[shash & newmask]);
-	if (u & 1) {
-	  hash &= newmask;
-	  u = gcrefu(newtab[hash]);
-	} else {  /* Revert string back to primary hash. */
-	  s->hash = shash;
-	  s->hashalg = 0;
-	  hash = (shash & newmask);
-	}
-      }
-      /* NOBARRIER: The string table is a GC root. */
-      setgcrefp(o->gch.nextgc, (u & ~(uintptr_t)1));
-      setgcrefp(newtab[hash], ((uintptr_t)o | (u & 1)));
-#else
-      hash &= newmask;
-      /* NOBARRIER: The string table is a GC root. */
-      setgcrefr(o->gch.nextgc, newtab[hash]);
-      setgcref(newtab[hash], o);
-#endif
+      str_reinsert(g, o);
       o = next;
     }
   }
+  g->str.migrate = i;
+  if (i > g->str.oldmask) {  /* Done: free old table. */
+    lj_mem_freevec(g, oldtab, g->str.oldmask+1, GCRef);
+    g->str.oldtab = NULL;
+    g->str.oldmask = 0;
+  }
+}
 
-  /* Free old table and replace with new table. */
-  lj_str_freetab(g);
+/*
+** Resize the string interning hash table (grow and shrink).
+**
+** The strings are migrated incrementally to the new table by lj_str_new()
+** and the GC. Lookups check both tables until the old one is empty.
+*/
+void lj_str_resize(lua_State *L, MSize newmask)
+{
+  global_State *g = G(L);
+  GCRef *newtab;
+
+  /* No resizing during GC traversal or if already too big. */
+  if (g->gc.state == GCSsweepstring || newmask >= LJ_MAX_STRTAB-1)
+    return;
+
+  if (g->str.oldtab)  /* Finish the previous resize first. */
+    lj_str_migrate(g, ~(MSize)0);
+
+  newtab = lj_mem_newvec(L, newmask+1, GCRef);
+  memset(newtab, 0, (newmask+1)*sizeof(GCRef));
+
+  if (g->str.tab) {  /* Keep the old table around until it's migrated. */
+    g->str.oldtab = g->str.tab;
+    g->str.oldmask = g->str.mask;
+    g->str.migrate = 0;
+  }
   g->str.tab = newtab;
   g->str.mask = newmask;
 }
 
 #if LUAJIT_SECURITY_STRHASH
 /* Rehash and rechain all strings in a chain. */
+static LJ_AINLINE GCstr *str_intern(lua_State *L, const char *str, MSize len,
+				    GCstr *sraw);
+
 static LJ_NOINLINE GCstr *lj_str_rehash_chain(lua_State *L, StrHash hashc,
-					      const char *str, MSize len)
+					      const char *str, MSize len,
+					      GCstr *sraw)
 {
   global_State *g = G(L);
   int ow = g->gc.state == GCSsweepstring ? otherwhite(g) : 0;  /* Sweeping? */
@@ -225,7 +329,6 @@ static LJ_NOINLINE GCstr *lj_str_rehash_chain(lua_State *L, StrHash hashc,
   MSize strmask = g->str.mask;
   GCobj *o = gcref(strtab[hashc & strmask]);
   setgcrefp(strtab[hashc & strmask], (void *)((uintptr_t)1));
-  g->str.second = 1;
   while (o) {
     uintptr_t u;
     GCobj *next = gcnext(o);
@@ -235,7 +338,8 @@ static LJ_NOINLINE GCstr *lj_str_rehash_chain(lua_State *L, StrHash hashc,
       if (((o->gch.marked ^ LJ_GC_WHITES) & ow)) {  /* String alive? */
 	lj_assertG(!isdead(g, o) || (o->gch.marked & LJ_GC_FIXED),
 		   "sweep of undead string");
-	makewhite(g, o);
+	if (!g->gc.sticky)
+	  makewhite(g, o);
       } else {  /* Free dead string. */
 	lj_assertG(isdead(g, o) || ow == LJ_GC_SFIXED,
 		   "sweep of unlive string");
@@ -258,7 +362,7 @@ static LJ_NOINLINE GCstr *lj_str_rehash_chain(lua_State *L, StrHash hashc,
     o = next;
   }
   /* Try to insert the pending string again. */
-  return lj_str_new(L, str, len);
+  return str_intern(L, str, len, sraw);
 }
 #endif
 
@@ -271,11 +375,34 @@ static LJ_NOINLINE GCstr *lj_str_rehash_chain(lua_State *L, StrHash hashc,
 #define STRID_RESEED_INTERVAL	0
 #endif
 
+/* Find a string in the old hash table during resize. */
+static GCstr *str_findold(global_State *g, const char *str, MSize len,
+			  StrHash hash)
+{
+  GCobj *o = gcref(g->str.oldtab[hash & g->str.oldmask]);
+#if LUAJIT_SECURITY_STRHASH
+  if (LJ_UNLIKELY((uintptr_t)o & 1)) {  /* Secondary hash for this chain? */
+    hash = hash_dense(g->str.seed, hash, str, len);
+    o = (GCobj *)(gcrefu(g->str.oldtab[hash & g->str.oldmask]) &
+		  ~(uintptr_t)1);
+  }
+#endif
+  for (; o != NULL; o = gcnext(o)) {
+    GCstr *sx = gco2str(o);
+    if (sx->hash == hash && sx->len == len &&
+	memcmp(str, strdata(sx), len) == 0) {
+      if (isdead(g, o)) flipwhite(o);  /* Resurrect if dead. */
+      return sx;
+    }
+  }
+  return NULL;
+}
+
 /* Allocate a new string and add to string interning table. */
 static GCstr *lj_str_alloc(lua_State *L, const char *str, MSize len,
-			   StrHash hash, int hashalg)
+			   StrHash hash, int hashalg, GCstr *sraw)
 {
-  GCstr *s = lj_mem_newt(L, lj_str_size(len), GCstr);
+  GCstr *s = sraw ? sraw : lj_mem_newt(L, lj_str_size(len), GCstr);
   global_State *g = G(L);
   uintptr_t u;
   newwhite(g, s);
@@ -296,9 +423,11 @@ static GCstr *lj_str_alloc(lua_State *L, const char *str, MSize len,
 #endif
   s->reserved = 0;
   s->hashalg = (uint8_t)hashalg;
-  /* Clear last 4 bytes of allocated memory. Implies zero-termination, too. */
-  *(uint32_t *)(strdatawr(s)+(len & ~(MSize)3)) = 0;
-  memcpy(strdatawr(s), str, len);
+  if (!sraw) {
+    /* Clear last 4 bytes of allocated memory. Implies zero-termination. */
+    *(uint32_t *)(strdatawr(s)+(len & ~(MSize)3)) = 0;
+    memcpy(strdatawr(s), str, len);
+  }
   /* Add to string hash table. */
   hash &= g->str.mask;
   u = gcrefu(g->str.tab[hash]);
@@ -307,52 +436,108 @@ static GCstr *lj_str_alloc(lua_State *L, const char *str, MSize len,
   setgcrefp(g->str.tab[hash], ((uintptr_t)s | (u & 1)));
   if (g->str.num++ > g->str.mask)  /* Allow a 100% load factor. */
     lj_str_resize(L, (g->str.mask<<1)+1);  /* Grow string table. */
+  else if (LJ_UNLIKELY(g->str.oldtab) && g->gc.state != GCSsweepstring)
+    lj_str_migrate(g, LJ_STR_MIGRATE);
   return s;  /* Return newly interned string. */
 }
 
-/* Intern a string and return string object. */
-GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
+/* Intern a string. Use the preallocated string sraw, if given. */
+static LJ_AINLINE GCstr *str_intern(lua_State *L, const char *str, MSize len,
+				    GCstr *sraw)
 {
   global_State *g = G(L);
-  if (lenx-1 < LJ_MAX_STR-1) {
-    MSize len = (MSize)lenx;
-    StrHash hash = hash_sparse(g->str.seed, str, len);
-    MSize coll = 0;
-    int hashalg = 0;
-    /* Check if the string has already been interned. */
-    GCobj *o = gcref(g->str.tab[hash & g->str.mask]);
+  StrHash hash = hash_sparse(g->str.seed, str, len);
+  MSize coll = 0;
+  int hashalg = 0;
+  /* Check if the string has already been interned. */
+  GCobj *o = gcref(g->str.tab[hash & g->str.mask]);
 #if LUAJIT_SECURITY_STRHASH
-    if (LJ_UNLIKELY((uintptr_t)o & 1)) {  /* Secondary hash for this chain? */
-      hashalg = 1;
-      hash = hash_dense(g->str.seed, hash, str, len);
-      o = (GCobj *)(gcrefu(g->str.tab[hash & g->str.mask]) & ~(uintptr_t)1);
-    }
+  if (LJ_UNLIKELY((uintptr_t)o & 1)) {  /* Secondary hash for this chain? */
+    hashalg = 1;
+    hash = hash_dense(g->str.seed, hash, str, len);
+    o = (GCobj *)(gcrefu(g->str.tab[hash & g->str.mask]) & ~(uintptr_t)1);
+  }
 #endif
-    while (o != NULL) {
-      GCstr *sx = gco2str(o);
-      if (sx->hash == hash && sx->len == len) {
-	if (memcmp(str, strdata(sx), len) == 0) {
-	  if (isdead(g, o)) flipwhite(o);  /* Resurrect if dead. */
-	  return sx;  /* Return existing string. */
-	}
-	coll++;
+  while (o != NULL) {
+    GCstr *sx = gco2str(o);
+    if (sx->hash == hash && sx->len == len) {
+      if (memcmp(str, strdata(sx), len) == 0) {
+	if (isdead(g, o)) flipwhite(o);  /* Resurrect if dead. */
+	if (sraw) lj_mem_free(g, sraw, lj_str_size(len));
+	return sx;  /* Return existing string. */
       }
       coll++;
-      o = gcnext(o);
     }
-#if LUAJIT_SECURITY_STRHASH
-    /* Rehash chain if there are too many collisions. */
-    if (LJ_UNLIKELY(coll > LJ_STR_MAXCOLL) && !hashalg) {
-      return lj_str_rehash_chain(L, hash, str, len);
+    coll++;
+    o = gcnext(o);
+  }
+  if (LJ_UNLIKELY(g->str.oldtab)) {  /* Resize in progress? */
+    GCstr *sx = str_findold(g, str, len, hashalg ?
+			    hash_sparse(g->str.seed, str, len) : hash);
+    if (sx) {
+      if (sraw) lj_mem_free(g, sraw, lj_str_size(len));
+      return sx;
     }
+  }
+#if LUAJIT_SECURITY_STRHASH
+  /* Rehash chain if there are too many collisions. */
+  if (LJ_UNLIKELY(coll > LJ_STR_MAXCOLL) && !hashalg) {
+    return lj_str_rehash_chain(L, hash, str, len, sraw);
+  }
 #endif
-    /* Otherwise allocate a new string. */
-    return lj_str_alloc(L, str, len, hash, hashalg);
+  /* Otherwise allocate a new string. */
+  return lj_str_alloc(L, str, len, hash, hashalg, sraw);
+}
+
+/* Intern a string and return string object. */
+GCstr *lj_str_new(lua_State *L, const char *str, size_t lenx)
+{
+  if (lenx-1 < LJ_MAX_STR-1) {
+    return str_intern(L, str, (MSize)lenx, NULL);
   } else {
     if (lenx)
       lj_err_msg(L, LJ_ERR_STROV);
-    return &g->strempty;
+    return &G(L)->strempty;
+  }
+}
+
+/*
+** Allocate an uninterned string to be filled in by the caller, e.g. to
+** read large amounts of data without an extra copy. Nothing may throw
+** before it's passed to lj_str_intern(), which may also shorten it.
+*/
+GCstr *lj_str_newraw(lua_State *L, MSize len)
+{
+  GCstr *s;
+  if (len >= LJ_MAX_STR)
+    lj_err_msg(L, LJ_ERR_STROV);
+  s = lj_mem_newt(L, lj_str_size(len), GCstr);
+  s->len = len;
+  return s;
+}
+
+/* Intern a string allocated by lj_str_newraw(), holding len bytes. */
+GCstr *lj_str_intern(lua_State *L, GCstr *s, MSize len)
+{
+  lj_assertL(len <= s->len, "bad raw string length");
+  if (len == 0) {
+    lj_mem_free(G(L), s, lj_str_size(s->len));
+    return &G(L)->strempty;
+  }
+  if (len != s->len) {  /* Shrink. May move to a slab and fail. */
+    global_State *g = G(L);
+    GCSize osz = lj_str_size(s->len), nsz = lj_str_size(len);
+    GCstr *sx = (GCstr *)g->allocf(g->allocd, s, osz, nsz);
+    if (!sx) {  /* Don't leak the raw string. */
+      lj_mem_free(g, s, osz);
+      lj_err_mem(L);
+    }
+    g->gc.total -= osz - nsz;
+    s = sx;
   }
+  /* Zero-fill the padding. Implies zero-termination, too. */
+  memset(strdatawr(s)+len, 0, (size_t)(((len+4) & ~(MSize)3) - len));
+  return str_intern(L, strdata(s), len, s);
 }
 
 void LJ_FASTCALL lj_str_free(global_State *g, GCstr *s)
@@ -16,13 +16,27 @@ LJ_FUNC const char *lj_str_find(const char *s, const char *f,
 				MSize slen, MSize flen);
 LJ_FUNC int lj_str_haspattern(GCstr *s);
 
+/* UTF-8 helpers. */
+LJ_FUNC const char *lj_str_utf8scan(const char *p, const char *q,
+				    const char *e, MSize *np);
+LJ_FUNC const char *lj_str_utf8dec(const char *p, const char *e,
+				   uint32_t *cp);
+LJ_FUNC int32_t LJ_FASTCALL lj_str_utf8len(GCstr *s);
+
 /* String interning. */
 LJ_FUNC void lj_str_resize(lua_State *L, MSize newmask);
+LJ_FUNC void lj_str_migrate(global_State *g, MSize n);
 LJ_FUNCA GCstr *lj_str_new(lua_State *L, const char *str, size_t len);
+LJ_FUNC GCstr *lj_str_newraw(lua_State *L, MSize len);
+LJ_FUNC GCstr *lj_str_intern(lua_State *L, GCstr *s, MSize len);
 LJ_FUNC void LJ_FASTCALL lj_str_free(global_State *g, GCstr *s);
 LJ_FUNC void LJ_FASTCALL lj_str_init(lua_State *L);
 #define lj_str_freetab(g) \
-  (lj_mem_freevec(g, g->str.tab, g->str.mask+1, GCRef))
+  do { \
+    if ((g)->str.oldtab) \
+      lj_mem_freevec((g), (g)->str.oldtab, (g)->str.oldmask+1, GCRef); \
+    lj_mem_freevec((g), (g)->str.tab, (g)->str.mask+1, GCRef); \
+  } while (0)
 
 #define lj_str_newz(L, s)	(lj_str_new(L, s, strlen(s)))
 #define lj_str_newlit(L, s)	(lj_str_new(L, "" s, sizeof(s)-1))
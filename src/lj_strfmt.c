@@ -9,9 +9,12 @@
 #define LUA_CORE
 
 #include "lj_obj.h"
+#include "lj_gc.h"
 #include "lj_err.h"
 #include "lj_buf.h"
 #include "lj_str.h"
+#include "lj_tab.h"
+#include "lj_udata.h"
 #include "lj_meta.h"
 #include "lj_state.h"
 #include "lj_char.h"
@@ -93,6 +96,46 @@ retlit:
   return fs->len ? STRFMT_LIT : STRFMT_EOF;
 }
 
+/* -- Compiled formats ---------------------------------------------------- */
+
+#define STRFMT_MAXCACHE	256	/* Max. length of a cached format string. */
+
+/* Compile format string into ops. Short formats are cached in a weak table.
+** The result is not anchored. Note: must not trigger a GC step, since the
+** recorder uses it, too.
+*/
+GCudata *lj_strfmt_compile(lua_State *L, GCstr *fmt)
+{
+  GCtab *t = tabref(G(L)->gcroot[GCROOT_STR_FMTCACHE]);
+  FormatState fs;
+  SFormatOp *op;
+  GCudata *ud;
+  MSize n = 1;
+  if (t) {
+    cTValue *tv = lj_tab_getstr(t, fmt);
+    if (tv && tvisudata(tv)) return udataV(tv);
+  }
+  lj_strfmt_init(&fs, strdata(fmt), fmt->len);
+  while (lj_strfmt_parse(&fs) != STRFMT_EOF) n++;
+  ud = lj_udata_new(L, n*(MSize)sizeof(SFormatOp), tabref(L->env));
+  op = (SFormatOp *)uddata(ud);
+  lj_strfmt_init(&fs, strdata(fmt), fmt->len);
+  do {
+    op->sf = lj_strfmt_parse(&fs);
+    if (op->sf == STRFMT_LIT || op->sf == STRFMT_ERR) {
+      op->ofs = (MSize)(fs.str - strdata(fmt));
+      op->len = fs.len;
+    } else {
+      op->ofs = op->len = 0;
+    }
+  } while ((op++)->sf != STRFMT_EOF);
+  if (t && fmt->len <= STRFMT_MAXCACHE) {
+    setudataV(L, lj_tab_setstr(L, t, fmt), ud);
+    lj_gc_anybarriert(L, t);
+  }
+  return ud;
+}
+
 /* -- Raw conversions ----------------------------------------------------- */
 
 #define WINT_R(x, sh, sc) \
@@ -374,15 +417,16 @@ int lj_strfmt_putarg(lua_State *L, SBuf *sb, int arg, int retry)
 {
   int narg = (int)(L->top - L->base);
   GCstr *fmt = lj_lib_checkstr(L, arg);
-  FormatState fs;
+  GCudata *ud = lj_strfmt_compile(L, fmt);
+  const SFormatOp *op = strfmt_ops(ud);
   SFormat sf;
-  lj_strfmt_init(&fs, strdata(fmt), fmt->len);
-  while ((sf = lj_strfmt_parse(&fs)) != STRFMT_EOF) {
+  setudataV(L, L->top++, ud);  /* Anchor ops, __tostring may run the GC. */
+  for (; (sf = op->sf) != STRFMT_EOF; op++) {
     if (sf == STRFMT_LIT) {
-      lj_buf_putmem(sb, fs.str, fs.len);
+      lj_buf_putmem(sb, strdata(fmt) + op->ofs, op->len);
     } else if (sf == STRFMT_ERR) {
       lj_err_callerv(L, LJ_ERR_STRFMT,
-		     strdata(lj_str_new(L, fs.str, fs.len)));
+		     strdata(lj_str_new(L, strdata(fmt) + op->ofs, op->len)));
     } else {
       TValue *o = &L->base[arg++];
       if (arg > narg)
@@ -477,6 +521,7 @@ int lj_strfmt_putarg(lua_State *L, SBuf *sb, int arg, int retry)
       }
     }
   }
+  L->top--;
   return retry;
 }
 
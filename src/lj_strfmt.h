@@ -72,8 +72,18 @@ typedef enum FormatType {
 #define STRFMT_MAXBUF_NUM	32  /* Must correspond with STRFMT_G14. */
 #define STRFMT_MAXBUF_PTR	(2+2*sizeof(ptrdiff_t))  /* "0x" + hex ptr. */
 
+/* Compiled format op. */
+typedef struct SFormatOp {
+  SFormat sf;		/* Format, STRFMT_LIT, STRFMT_ERR or STRFMT_EOF. */
+  MSize ofs;		/* Offset of literal or error text in format string. */
+  MSize len;		/* Length of literal or error text. */
+} SFormatOp;
+
+#define strfmt_ops(ud)	((const SFormatOp *)uddata((ud)))
+
 /* Format parser. */
 LJ_FUNC SFormat LJ_FASTCALL lj_strfmt_parse(FormatState *fs);
+LJ_FUNC GCudata *lj_strfmt_compile(lua_State *L, GCstr *fmt);
 
 static LJ_AINLINE void lj_strfmt_init(FormatState *fs, const char *p, MSize len)
 {
@@ -88,6 +98,26 @@ LJ_FUNC char * LJ_FASTCALL lj_strfmt_wint(char *p, int32_t k);
 LJ_FUNC char * LJ_FASTCALL lj_strfmt_wptr(char *p, const void *v);
 LJ_FUNC char * LJ_FASTCALL lj_strfmt_wuleb128(char *p, uint32_t v);
 LJ_FUNC const char *lj_strfmt_wstrnum(lua_State *L, cTValue *o, MSize *lenp);
+LJ_FUNC char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p);
+
+/* Return high 64 bits of a*b and store low 64 bits in *lo. */
+static LJ_AINLINE uint64_t lj_strfmt_mulhi(uint64_t a, uint64_t b,
+					   uint64_t *lo)
+{
+#if defined(__SIZEOF_INT128__)
+  unsigned __int128 r = (unsigned __int128)a * b;
+  *lo = (uint64_t)r;
+  return (uint64_t)(r >> 64);
+#else
+  uint64_t al = (uint32_t)a, ah = a >> 32, bl = (uint32_t)b, bh = b >> 32;
+  uint64_t ll = al*bl, lh = al*bh, hl = ah*bl;
+  uint64_t mid = (ll >> 32) + (uint32_t)lh + (uint32_t)hl;
+  *lo = (mid << 32) | (uint32_t)ll;
+  return ah*bh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+LJ_FUNC int32_t lj_strfmt_pow10(int32_t k, uint64_t *mh, uint64_t *ml);
 
 /* Unformatted conversions to buffer. */
 LJ_FUNC SBuf * LJ_FASTCALL lj_strfmt_putint(SBuf *sb, int32_t k);
@@ -57,6 +57,65 @@ static uint32_t ndigits_dec_threshold[] = {
   9999999U, 99999999U, 999999999U, 0xffffffffU
 };
 
+/*
+** Normalized 128 bit mantissas m and binary exponents e of 10^(20*i-320)
+** for i in range 0 through 33, such that 10^(20*i-320) ~= m*2^e with
+** 2^127 <= m < 2^128. Rounded to nearest.
+*/
+static const uint64_t fnum_pow10_m[][2] = {
+  { U64x(fd00b897,478238d0), U64x(8920b098,955522b5) },
+  { U64x(ab70fe17,c79ac6ca), U64x(6dbd630a,48aaf407) },
+  { U64x(e858ad24,8f5c22c9), U64x(d1b3400f,8f9cff69) },
+  { U64x(9d71ac8f,ada6c9b5), U64x(6f773fc3,603db4a9) },
+  { U64x(d5605fcd,cf32e1d6), U64x(fb1e4a9a,90880a65) },
+  { U64x(9096ea6f,3848984f), U64x(3ff0d2c8,5def7622) },
+  { U64x(c3f490aa,77bd60fc), U64x(bedbfc44,11068a9d) },
+  { U64x(84c8d4df,d2c63f3b), U64x(29ecd9f4,0041e073) },
+  { U64x(b3f4e093,db73a093), U64x(59ed2167,65690f57) },
+  { U64x(f3e2f893,dec3f126), U64x(5a89dba3,c3efccfb) },
+  { U64x(a54394fe,1eedb8fe), U64x(c2974eb4,ee658829) },
+  { U64x(dff97724,70297ebd), U64x(59787e2b,93bc56f7) },
+  { U64x(97c560ba,6b0919a5), U64x(dccd879f,c967d41a) },
+  { U64x(cdb02555,653131b6), U64x(3792f412,cb06794d) },
+  { U64x(8b61313b,babce2c6), U64x(2323ac4b,3b3da015) },
+  { U64x(bce50864,92111aea), U64x(88f4bb1c,a6bcf584) },
+  { U64x(80000000,00000000), U64x(00000000,00000000) },
+  { U64x(ad78ebc5,ac620000), U64x(00000000,00000000) },
+  { U64x(eb194f8e,1ae525fd), U64x(5dcfab08,00000000) },
+  { U64x(9f4f2726,179a2245), U64x(01d76242,2c946591) },
+  { U64x(d7e77a8f,87daf7fb), U64x(dc33745e,c97be906) },
+  { U64x(924d692c,a61be758), U64x(593c2626,705f9c56) },
+  { U64x(c646d635,01a1511d), U64x(b281e1fd,541501b9) },
+  { U64x(865b8692,5b9bc5c2), U64x(0b8a2392,ba45a9b2) },
+  { U64x(b616a12b,7fe617aa), U64x(577b986b,314d6009) },
+  { U64x(f6c69a72,a3989f5b), U64x(8aad549e,57273d45) },
+  { U64x(a738c6be,bb12d16c), U64x(b428f8ac,016561db) },
+  { U64x(e2a0b5dc,971f303a), U64x(2e44ae64,840fd61e) },
+  { U64x(9991a6f3,d6bf1765), U64x(acca6da1,e0a8ef29) },
+  { U64x(d01fef10,a657842c), U64x(2d2b7569,b0432d85) },
+  { U64x(8d07e334,55637eb2), U64x(db0b487b,6423e1e8) },
+  { U64x(bf21e440,03acdd2c), U64x(e0470a63,e6bd56c3) },
+  { U64x(81842f29,f2cce375), U64x(e6a11583,00d46640) },
+  { U64x(af87023b,9bf0ee6a), U64x(eb8fad7c,7f8680b4) }
+};
+
+static const int16_t fnum_pow10_e[] = {
+  -1191, -1124, -1058, -991, -925, -858, -792, -725, -659, -593, -526, -460,
+  -393, -327, -260, -194, -127, -61, 5, 72, 138, 205, 271, 338, 404, 470, 537,
+  603, 670, 736, 803, 869, 936, 1002
+};
+
+/* 10^r for r in range 0 through 19. */
+static const uint64_t fnum_pow10_r[] = {
+  U64x(00000000,00000001), U64x(00000000,0000000a), U64x(00000000,00000064),
+  U64x(00000000,000003e8), U64x(00000000,00002710), U64x(00000000,000186a0),
+  U64x(00000000,000f4240), U64x(00000000,00989680), U64x(00000000,05f5e100),
+  U64x(00000000,3b9aca00), U64x(00000002,540be400), U64x(00000017,4876e800),
+  U64x(000000e8,d4a51000), U64x(00000918,4e72a000), U64x(00005af3,107a4000),
+  U64x(00038d7e,a4c68000), U64x(002386f2,6fc10000), U64x(01634578,5d8a0000),
+  U64x(0de0b6b3,a7640000), U64x(8ac72304,89e80000)
+};
+
 /* -- Helper functions ---------------------------------------------------- */
 
 /* Compute the number of digits in the decimal representation of x. */
@@ -263,10 +322,137 @@ static int nd_similar(uint32_t* nd, uint32_t ndhi, uint32_t* ref, MSize hilen,
   return !memcmp(nd9, ref9, prec) && (nd9[prec] < '5') == (ref9[prec] < '5');
 }
 
+/* -- Fast path for %e and %g -------------------------------------------- */
+
+/*
+** Get a 128 bit approximation of 10^k for k in range -320 through 359.
+** Returns e such that 10^k ~= (mh*2^64+ml) * 2^e with mh >= 2^63. The
+** relative error is below 2^-125.
+*/
+int32_t lj_strfmt_pow10(int32_t k, uint64_t *mh, uint64_t *ml)
+{
+  uint32_t i = (uint32_t)(k + 320) / 20, r = (uint32_t)(k + 320) % 20;
+  uint64_t h = fnum_pow10_m[i][0], l = fnum_pow10_m[i][1];
+  int32_t e = fnum_pow10_e[i];
+  lj_assertX(k >= -320 && k < 360, "bad power of ten %d", k);
+  if (r) {  /* Multiply with the remaining exact power of ten. */
+    uint64_t p = fnum_pow10_r[r], x, lo;
+    uint32_t sh = lj_fls64(p) ^ 63;
+    p <<= sh;
+    e += 64 - (int32_t)sh;
+    x = lj_strfmt_mulhi(l, p, &lo);
+    h = lj_strfmt_mulhi(h, p, &l);
+    l += x; h += (l < x);
+    if (!(h >> 63)) { h = (h << 1) | (l >> 63); l <<= 1; e--; }
+  }
+  *mh = h;
+  *ml = l;
+  return e;
+}
+
+/* Fraction bits closer than this to a rounding boundary are ambiguous. */
+#define FNUM_SLOP	1024
+
+/*
+** Compute the nd (1 <= nd <= 17) most significant decimal digits of the
+** finite non-zero double u, correctly rounded, and the decimal exponent of
+** the first digit. This multiplies the mantissa with a 128 bit approximation
+** of a power of ten. The error is far below FNUM_SLOP, so anything outside
+** the slop around a rounding boundary is exact. Returns 0 for the rest
+** (including exact ties), which is left to the "nd" code.
+*/
+static int fnum_digits(uint64_t u, uint32_t nd, uint64_t *dig, int32_t *ep)
+{
+  uint64_t m = u & U64x(000fffff,ffffffff), mh, ml, yh, yl, lo, x, fr;
+  int32_t e = (int32_t)((u >> 52) & 0x7ff), de, k;
+  uint32_t sh;
+  if (e) m |= U64x(00100000,00000000); else e++;
+  sh = lj_fls64(m) ^ 63;
+  m <<= sh;
+  e -= 1075 + (int32_t)sh;  /* |n| = m * 2^e with 2^63 <= m < 2^64. */
+  de = ((e + 63) * 78913) >> 18;  /* floor(log10(2^(e+63))) <= exponent. */
+  k = (int32_t)nd - 1 - de;  /* |n| * 10^k has nd or nd+1 integer digits. */
+  e += lj_strfmt_pow10(k, &mh, &ml);
+  x = lj_strfmt_mulhi(m, ml, &lo);
+  yh = lj_strfmt_mulhi(m, mh, &yl);
+  yl += x; yh += (yl < x);
+  sh = (uint32_t)(-e - 128);  /* Number of fraction bits in yh. */
+  if (sh - 1 >= 63) return 0;
+  x = yh >> sh;
+  fr = (yh << (64 - sh)) | (yl >> sh);
+  if (x >= fnum_pow10_r[nd]) {  /* Drop one more digit. */
+    uint64_t q = x / 10;
+    uint32_t rem = (uint32_t)(x - q*10);
+    if (x >= fnum_pow10_r[nd+1] ||
+	(rem == 5 ? fr < FNUM_SLOP : (rem == 4 && fr > ~(uint64_t)FNUM_SLOP)))
+      return 0;
+    x = q + (rem >= 5);
+    de++;
+  } else {
+    if (fr - (U64x(80000000,00000000) - FNUM_SLOP) <= 2*FNUM_SLOP)
+      return 0;
+    x += fr >> 63;
+    if (x < fnum_pow10_r[nd-1]) return 0;
+  }
+  if (x == fnum_pow10_r[nd]) { x = fnum_pow10_r[nd-1]; de++; }
+  *dig = x;
+  *ep = de;
+  return 1;
+}
+
+/* Write %e or %g without flags or width. Returns NULL if undecided. */
+static char *fnum_fast(SBuf *sb, SFormat sf, uint64_t u, char *p)
+{
+  uint32_t prec = STRFMT_PREC(sf), nd;
+  uint64_t dig, hi;
+  int32_t e;
+  char d[18], *q;
+  prec += ((int32_t)prec >> 31) & 7;  /* Default precision is 6. */
+  if (STRFMT_FP(sf) == STRFMT_FP(STRFMT_T_FP_G))
+    prec += (prec == 0);
+  else
+    prec++;
+  if (prec > 17 || !fnum_digits(u, prec, &dig, &e)) return NULL;
+  if (!p) p = lj_buf_more(sb, STRFMT_MAXBUF_NUM);
+  hi = dig / 1000000000;
+  lj_strfmt_wuint9(d, (uint32_t)hi);
+  lj_strfmt_wuint9(d + 9, (uint32_t)(dig - hi*1000000000));
+  q = d + 18 - prec;
+  nd = prec;
+  if ((int64_t)u < 0) *p++ = '-';
+  if (STRFMT_FP(sf) == STRFMT_FP(STRFMT_T_FP_G)) {
+    while (nd > 1 && q[nd-1] == '0') nd--;  /* Strip trailing zeroes. */
+    if (e >= -4 && e < (int32_t)prec) {  /* Like %f. */
+      if (e < 0) {
+	*p++ = '0'; *p++ = '.';
+	while (++e < 0) *p++ = '0';
+	memcpy(p, q, nd); p += nd;
+      } else if (nd <= (uint32_t)e + 1) {
+	memcpy(p, q, nd); p += nd;
+	while (nd++ <= (uint32_t)e) *p++ = '0';
+      } else {
+	memcpy(p, q, e + 1); p += e + 1;
+	*p++ = '.';
+	memcpy(p, q + e + 1, nd - e - 1); p += nd - e - 1;
+      }
+      return p;
+    }
+  }
+  *p++ = *q;
+  if (nd > 1) {
+    *p++ = '.';
+    memcpy(p, q + 1, nd - 1); p += nd - 1;
+  }
+  *p++ = (sf & STRFMT_F_UPPER) ? 'E' : 'e';
+  if (e < 0) { *p++ = '-'; e = -e; } else { *p++ = '+'; }
+  if (e < 10) *p++ = '0';
+  return lj_strfmt_wint(p, e);
+}
+
 /* -- Formatted conversions to buffer ------------------------------------- */
 
 /* Write formatted floating-point number to either sb or p. */
-static char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p)
+char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p)
 {
   MSize width = STRFMT_WIDTH(sf), prec = STRFMT_PREC(sf), len;
   TValue t;
@@ -351,6 +537,10 @@ static char *lj_strfmt_wfnum(SBuf *sb, SFormat sf, lua_Number n, char *p)
     uint32_t ndhi = 0, ndlo, i;
     int32_t e = (t.u32.hi >> 20) & 0x7ff, ndebias = 0;
     char prefix = 0, *q;
+    if (((sf & ~(SFormat)(STRFMT_F_UPPER | (255u << STRFMT_SH_PREC))) |
+	 STRFMT_T_FP_F) == STRFMT_G && n != 0 &&
+	(q = fnum_fast(sb, sf, t.u64, p)) != NULL)
+      return q;
     if (t.u32.hi & 0x80000000) prefix = '-';
     else if ((sf & STRFMT_F_PLUS)) prefix = '+';
     else if ((sf & STRFMT_F_SPACE)) prefix = ' ';
@@ -10,6 +10,7 @@
 
 #include "lj_obj.h"
 #include "lj_char.h"
+#include "lj_strfmt.h"
 #include "lj_strscan.h"
 
 /* -- Scanning numbers ---------------------------------------------------- */
@@ -72,6 +73,15 @@
 
 #define casecmp(c, k)	(((c) | 0x20) == k)
 
+/* Powers of ten which are exactly representable as a double. */
+static const double strscan_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12,
+  1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+/* Fraction bits closer than this to a rounding boundary are ambiguous. */
+#define STRSCAN_SLOP	1024
+
 /* Final conversion to double. */
 static void strscan_double(uint64_t x, TValue *o, int32_t ex2, int32_t neg)
 {
@@ -179,6 +189,86 @@ static StrScanFmt strscan_oct(const uint8_t *p, TValue *o,
   return fmt;
 }
 
+/* Check whether 8 bytes are all ASCII digits. */
+#define strscan_isdig8(v) \
+  ((((v) + U64x(46464646,46464646)) | ((v) - U64x(30303030,30303030))) & \
+   U64x(80808080,80808080)) == 0
+
+/* Convert 8 ASCII digits to an integer (first digit in the low byte). */
+static LJ_AINLINE uint32_t strscan_swar8(uint64_t v)
+{
+  v -= U64x(30303030,30303030);
+  v = (v * 10) + (v >> 8);
+  v = (((v & U64x(000000ff,000000ff)) * U64x(000f4240,00000064)) +
+       (((v >> 16) & U64x(000000ff,000000ff)) * U64x(00002710,00000001)));
+  return (uint32_t)(v >> 32);
+}
+
+/*
+** Fast path for decimal numbers with 1-19 significant digits. Exact cases
+** need only a single FP multiply or divide. Otherwise the digits are
+** multiplied with a 128 bit approximation of the power of ten (similar to
+** the Eisel-Lemire algorithm). Returns 0 if the result is too close to a
+** rounding boundary or is a denormal, an overflow or an underflow.
+*/
+static int strscan_dec_fast(const uint8_t *p, TValue *o,
+			    int32_t ex10, int32_t neg, uint32_t dig)
+{
+  uint64_t x = 0, mh, ml, yh, yl, lo, t;
+  uint32_t sh, r, half;
+  int32_t e;
+
+  /* Accumulate digits, 8 at a time if there's no decimal point. */
+  while (dig) {
+    uint64_t v;
+    if (dig >= 8) {
+      memcpy(&v, p, 8);
+#if LJ_BE
+      v = lj_bswap64(v);
+#endif
+      if (strscan_isdig8(v)) {
+	x = x * 100000000 + strscan_swar8(v);
+	p += 8; dig -= 8;
+	continue;
+      }
+    }
+    x = x * 10 + ((*p != '.' ? *p : *++p) & 15);
+    p++; dig--;
+  }
+
+  /* Both x and the power of ten are exact doubles. Round only once. */
+  if (ex10 >= -22 && ex10 <= 22 && !(x >> 53)) {
+    double n = (double)(int64_t)x;
+    if (ex10 >= 0) n *= strscan_pow10[ex10]; else n /= strscan_pow10[-ex10];
+    o->n = neg ? -n : n;
+    return 1;
+  }
+
+  /* |n| ~= (yh*2^64+yl) * 2^(e+64) with 2^126 <= yh*2^64+yl < 2^128. */
+  if (ex10 < -320 || ex10 > 308) return 0;
+  sh = lj_fls64(x) ^ 63;
+  e = lj_strfmt_pow10(ex10, &mh, &ml) - (int32_t)sh;
+  x <<= sh;
+  t = lj_strfmt_mulhi(x, ml, &lo);
+  yh = lj_strfmt_mulhi(x, mh, &yl);
+  yl += t; yh += (yl < t);
+
+  /* Round to 53 bits. Leave anything close to a tie to the slow path. */
+  sh = 10 + (uint32_t)(yh >> 63);
+  r = (uint32_t)yh & ((1u << sh) - 1);
+  half = 1u << (sh - 1);
+  if ((r == half && yl <= STRSCAN_SLOP) ||
+      (r == half - 1 && yl >= ~(uint64_t)STRSCAN_SLOP))
+    return 0;
+  x = (yh >> sh) + (r >= half);
+  e += 128 + (int32_t)sh + 1075;
+  if ((x >> 53)) { x >>= 1; e++; }
+  if ((uint32_t)(e - 1) >= 0x7fe) return 0;
+  o->u64 = ((uint64_t)neg << 63) | ((uint64_t)e << 52) |
+	   (x & U64x(000fffff,ffffffff));
+  return 1;
+}
+
 /* Parse decimal number. */
 static StrScanFmt strscan_dec(const uint8_t *p, TValue *o,
 			      StrScanFmt fmt, uint32_t opt,
@@ -186,6 +276,10 @@ static StrScanFmt strscan_dec(const uint8_t *p, TValue *o,
 {
   uint8_t xi[STRSCAN_DDIG], *xip = xi;
 
+  if ((fmt == STRSCAN_NUM || fmt == STRSCAN_IMAG) && dig - 1 < 19 &&
+      strscan_dec_fast(p, o, ex10, neg, dig))
+    return fmt;
+
   if (dig) {
     uint32_t i = dig;
     if (i > STRSCAN_MAXDIG) {
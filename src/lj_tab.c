@@ -226,6 +226,18 @@ void LJ_FASTCALL lj_tab_free(global_State *g, GCtab *t)
 
 /* -- Table resizing ------------------------------------------------------ */
 
+/* Reinsert a key from the old hash part. Keys are unique, so no lookup. */
+static TValue *reinsertkey(lua_State *L, GCtab *t, cTValue *key)
+{
+  if (tvisnum(key)) {
+    lua_Number nk = numV(key);
+    int32_t k = lj_num2int(nk);
+    if ((uint32_t)k < t->asize && nk == (lua_Number)k)
+      return arrayslot(t, k);
+  }
+  return lj_tab_newkey(L, t, key);
+}
+
 /* Resize a table to fit the new array/hash part sizes. */
 void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
 {
@@ -283,7 +295,7 @@ void lj_tab_resize(lua_State *L, GCtab *t, uint32_t asize, uint32_t hbits)
     for (i = 0; i <= oldhmask; i++) {
       Node *n = &oldnode[i];
       if (!tvisnil(&n->val))
-	copyTV(L, lj_tab_set(L, t, &n->key), &n->val);
+	copyTV(L, reinsertkey(L, t, &n->key), &n->val);
     }
     g = G(L);
     lj_mem_freevec(g, oldnode, oldhmask+1, Node);
@@ -9,6 +9,7 @@
 #include "lj_obj.h"
 #include "lj_gc.h"
 #include "lj_err.h"
+#include "lj_buf.h"
 #include "lj_udata.h"
 
 GCudata *lj_udata_new(lua_State *L, MSize sz, GCtab *env)
@@ -30,6 +31,10 @@ GCudata *lj_udata_new(lua_State *L, MSize sz, GCtab *env)
 
 void LJ_FASTCALL lj_udata_free(global_State *g, GCudata *ud)
 {
+#if LJ_HASBUFFER
+  if (LJ_UNLIKELY(ud->udtype == UDTYPE_MMAP))
+    lj_bufx_unmap(ud);
+#endif
   lj_mem_free(g, ud, sizeudata(ud));
 }
 
@@ -87,5 +87,6 @@
 #include "lib_jit.c"
 #include "lib_ffi.c"
 #include "lib_buffer.c"
+#include "lib_utf8.c"
 #include "lib_init.c"
 